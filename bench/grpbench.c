@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2010-2014 Ganael LAPLANCHE <ganael.laplanche@martymac.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+   Group archive benchmark harness
+
+   Builds libgrp and grpar's code into the harness, counting the system
+   calls they issue, and times the following phases on a given archive :
+   init    : grp_open() + grp_close()
+   list    : dump_grp_files() (output discarded)
+   extract : extract_all_files() into a scratch directory
+
+   For each phase, best wall time out of several runs is reported, along
+   with system calls issued, data throughput (MB/s, based on total member
+   size) and files per second.
+
+   Listing goes through stdio, whose write(2) calls cannot be wrapped : on
+   Linux, they are taken from /proc/self/io instead.
+*/
+
+#if defined(__linux__)
+  #define _GNU_SOURCE
+#endif
+
+/* Headers used by libgrp.c and grpar.c, included before system calls get
+   wrapped */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__linux__)
+  #include <sys/sendfile.h>
+#endif
+
+/* clock_gettime(2) */
+#include <time.h>
+
+/* System calls issued by libgrp and grpar's code */
+static volatile unsigned long bench_syscalls = 0;
+#define COUNTED(call) (__sync_fetch_and_add(&bench_syscalls, 1), (call))
+
+#define open(...)               COUNTED(open(__VA_ARGS__))
+#define openat(...)             COUNTED(openat(__VA_ARGS__))
+#define close(fd)               COUNTED(close(fd))
+#define read(fd, buf, n)        COUNTED(read(fd, buf, n))
+#define pread(fd, buf, n, o)    COUNTED(pread(fd, buf, n, o))
+#define write(fd, buf, n)       COUNTED(write(fd, buf, n))
+#define lseek(fd, o, w)         COUNTED(lseek(fd, o, w))
+#define stat(path, st)          COUNTED(stat(path, st))
+#define fstat(fd, st)           COUNTED(fstat(fd, st))
+#define mmap(...)               COUNTED(mmap(__VA_ARGS__))
+#define munmap(addr, len)       COUNTED(munmap(addr, len))
+#define madvise(addr, len, adv) COUNTED(madvise(addr, len, adv))
+#define copy_file_range(...)    COUNTED(copy_file_range(__VA_ARGS__))
+#define sendfile(...)           COUNTED(sendfile(__VA_ARGS__))
+#define splice(...)             COUNTED(splice(__VA_ARGS__))
+#define syscall(...)            COUNTED(syscall(__VA_ARGS__))
+
+#include "../libgrp.c"
+#define main grpar_main
+#include "../grpar.c"
+#undef main
+
+#undef open
+#undef openat
+#undef close
+#undef read
+#undef pread
+#undef write
+#undef lseek
+#undef stat
+#undef fstat
+#undef mmap
+#undef munmap
+#undef madvise
+#undef copy_file_range
+#undef sendfile
+#undef splice
+#undef syscall
+
+#define BENCH_RUNS  3
+
+/* Benchmark phases */
+#define PHASE_INIT      0
+#define PHASE_LIST      1
+#define PHASE_EXTRACT   2
+#define PHASE_NUM       3
+static const char *phase_names[] = { "init", "list", "extract" };
+
+/* Phase results */
+struct phase_result {
+    double seconds;                         /* best wall time */
+    unsigned long syscalls;                 /* system calls for that run */
+};
+
+/* Current time, in seconds */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Number of write system calls issued by the process so far, as reported
+   by /proc/self/io (0 if unavailable) */
+static unsigned long
+write_syscalls(void)
+{
+    unsigned long syscw = 0;
+    char line[128];
+    FILE *io;
+
+    if((io = fopen("/proc/self/io", "r")) == NULL)
+        return (0);
+    while(fgets(line, sizeof(line), io) != NULL) {
+        if(sscanf(line, "syscw: %lu", &syscw) == 1)
+            break;
+    }
+    fclose(io);
+    return (syscw);
+}
+
+/* Remove extracted files from scratch directory */
+static void
+clean_scratch(const char *scratch_dir, struct grp_archive *archive)
+{
+    const struct grp_file *current;
+    char path[4096];
+
+    for(current = grp_next(archive, NULL) ; current != NULL ;
+        current = grp_next(archive, current)) {
+        snprintf(path, sizeof(path), "%s/%s", scratch_dir,
+            current->file_name);
+        unlink(path);
+    }
+}
+
+/* Run one phase, updating result if run is the best so far
+   Returns 0 on success, -1 on error */
+static int
+run_phase(int phase, const char *filename, const char *scratch_dir,
+    int open_flags, unsigned int num_threads, uint8_t uring,
+    struct phase_result *result)
+{
+    struct grp_archive *archive = NULL;
+    struct dest_dir dest_dir;
+    int stdout_handle = -1;
+    int null_handle;
+    double start, elapsed;
+    unsigned long syscalls;
+    unsigned long stdio_syscalls = 0;
+    int err = 0;
+
+    /* Setup (not measured) */
+    if(phase != PHASE_INIT) {
+        if((archive = grp_open(filename, open_flags)) == NULL)
+            return (-1);
+    }
+    if(phase == PHASE_LIST) {
+        fflush(stdout);
+        if(((null_handle = open("/dev/null", O_WRONLY)) < 0) ||
+            ((stdout_handle = dup(STDOUT_FILENO)) < 0)) {
+            fprintf(stderr, "cannot redirect standard output\n");
+            grp_close(archive);
+            return (-1);
+        }
+        dup2(null_handle, STDOUT_FILENO);
+        close(null_handle);
+    }
+
+    if(phase == PHASE_LIST)
+        stdio_syscalls = write_syscalls();
+    bench_syscalls = 0;
+    start = now();
+    switch(phase) {
+        case PHASE_INIT:
+            if((archive = grp_open(filename, open_flags)) == NULL)
+                err = -1;
+            else
+                grp_close(archive);
+            break;
+        case PHASE_LIST:
+        {
+            struct layer layer = { filename, archive, NULL, 0 };
+
+            dump_grp_files(&layer, 1, FORMAT_TEXT, 1);
+            fflush(stdout);
+            break;
+        }
+        case PHASE_EXTRACT:
+            if((err = open_dest_dir(scratch_dir, &dest_dir)) == 0) {
+                err = extract_all_files(archive, &dest_dir, NULL, 0,
+                    NULL, num_threads, uring, 0);
+                close_dest_dir(&dest_dir);
+            }
+            break;
+    }
+    elapsed = now() - start;
+    if(phase == PHASE_LIST)
+        stdio_syscalls = write_syscalls() - stdio_syscalls;
+    syscalls = bench_syscalls + stdio_syscalls;
+
+    /* Teardown (not measured) */
+    if(phase == PHASE_LIST) {
+        dup2(stdout_handle, STDOUT_FILENO);
+        close(stdout_handle);
+    }
+    if(phase == PHASE_EXTRACT)
+        clean_scratch(scratch_dir, archive);
+    if(phase != PHASE_INIT)
+        grp_close(archive);
+
+    if(err != 0)
+        return (-1);
+    if((result->seconds < 0) || (elapsed < result->seconds)) {
+        result->seconds = elapsed;
+        result->syscalls = syscalls;
+    }
+    return (0);
+}
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr, "usage: grpbench [-r runs] [-j jobs] [-m] [-U] grp_file "
+        "scratch_dir\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int ch;
+    int runs = BENCH_RUNS;
+    unsigned int num_threads = 1;
+    int open_flags = 0;
+    uint8_t uring = 0;
+    struct grp_archive *archive;
+    const struct grp_file *current;
+    struct phase_result results[PHASE_NUM];
+    uint64_t total = 0;
+    uint32_t num_files;
+    int phase, r;
+
+    while((ch = getopt(argc, argv, "r:j:mU")) != -1) {
+        switch(ch) {
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                break;
+            case 'm':
+                open_flags |= GRP_OPEN_MMAP;
+                break;
+            case 'U':
+                uring = 1;
+                break;
+            default:
+                bench_usage();
+                return (1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if((argc != 2) || (runs < 1) || (num_threads < 1)) {
+        bench_usage();
+        return (1);
+    }
+    if((uring == 1) && !grp_uring_supported()) {
+        fprintf(stderr, "io_uring unavailable\n");
+        return (1);
+    }
+
+    /* Archive statistics */
+    if((archive = grp_open(argv[0], open_flags)) == NULL)
+        return (1);
+    for(current = grp_next(archive, NULL) ; current != NULL ;
+        current = grp_next(archive, current))
+        total += current->file_size;
+    num_files = grp_num_files(archive);
+    grp_close(archive);
+
+    for(phase = 0 ; phase < PHASE_NUM ; phase++) {
+        results[phase].seconds = -1;
+        for(r = 0 ; r < runs ; r++) {
+            if(run_phase(phase, argv[0], argv[1], open_flags, num_threads,
+                uring, &results[phase]) < 0) {
+                fprintf(stderr, "%s phase failed\n", phase_names[phase]);
+                return (1);
+            }
+        }
+    }
+
+    fprintf(stdout, "%s : %u files, %.1f MB, engine %s%s, %u job(s), "
+        "best of %d run(s)\n", argv[0], num_files, total / 1e6,
+        (open_flags & GRP_OPEN_MMAP) ? "mmap" : "fd",
+        (uring == 1) ? "+io_uring" : "", num_threads, runs);
+    fprintf(stdout, "%-8s %12s %10s %12s %12s\n", "phase", "time (ms)",
+        "syscalls", "MB/s", "files/s");
+    for(phase = 0 ; phase < PHASE_NUM ; phase++) {
+        double seconds = (results[phase].seconds > 0) ?
+            results[phase].seconds : 1e-9;
+
+        fprintf(stdout, "%-8s %12.3f %10lu %12.1f %12.0f\n",
+            phase_names[phase], results[phase].seconds * 1e3,
+            results[phase].syscalls, total / 1e6 / seconds,
+            num_files / seconds);
+    }
+    return (0);
+}
@@ -0,0 +1,217 @@
+/*-
+ * Copyright (c) 2010-2014 Ganael LAPLANCHE <ganael.laplanche@martymac.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+   Synthetic group archive generator, for benchmarking purposes
+
+   Profiles :
+   tiny  : many tiny files (20000 files, 0 to 1 KiB)
+   huge  : a few huge files (4 files, 64 MiB)
+   mixed : mixed distribution (1000 files, log-uniform from 16 bytes to
+           1 MiB)
+
+   Member data is pseudo-random (thus incompressible) and reproducible for
+   a given seed.
+*/
+
+/* uint32_t, uint64_t */
+#include <stdint.h>
+
+/* fprintf(3) */
+#include <stdio.h>
+
+/* malloc(3), strtoul(3) */
+#include <stdlib.h>
+
+/* strcmp(3) */
+#include <string.h>
+
+/* getopt(3) */
+#include <unistd.h>
+
+/* log(3), exp(3) */
+#include <math.h>
+
+#define GRPHDR_MAGIC        "KenSilverman"
+#define GRPHDR_MAGICLEN     12
+#define GRPHDR_FILENAMELEN  12
+
+#define WBUF_SIZE           (1024 * 1024)
+
+/* xorshift64* pseudo-random generator */
+static uint64_t
+next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * UINT64_C(2685821657736338717));
+}
+
+/* Store a 32-bit little-endian value */
+static void
+put_le32(unsigned char *buf, uint32_t value)
+{
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: grpgen [-n num_files] [-z max_size] [-s seed] "
+        "tiny|huge|mixed grp_file\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int ch;
+    uint32_t num_files = 0;
+    uint32_t max_size = 0;
+    uint64_t seed = 1;
+    const char *profile;
+    FILE *out;
+    uint32_t *sizes;
+    unsigned char *buf;
+    unsigned char entry[GRPHDR_FILENAMELEN + 4];
+    uint64_t state;
+    uint64_t total = 0;
+    uint32_t i;
+
+    while((ch = getopt(argc, argv, "n:z:s:")) != -1) {
+        switch(ch) {
+            case 'n':
+                num_files = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                max_size = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return (1);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if(argc != 2) {
+        usage();
+        return (1);
+    }
+    profile = argv[0];
+
+    /* Profile defaults */
+    if(strcmp(profile, "tiny") == 0) {
+        num_files = (num_files == 0) ? 20000 : num_files;
+        max_size = (max_size == 0) ? 1024 : max_size;
+    }
+    else if(strcmp(profile, "huge") == 0) {
+        num_files = (num_files == 0) ? 4 : num_files;
+        max_size = (max_size == 0) ? 64 * 1024 * 1024 : max_size;
+    }
+    else if(strcmp(profile, "mixed") == 0) {
+        num_files = (num_files == 0) ? 1000 : num_files;
+        max_size = (max_size == 0) ? 1024 * 1024 : max_size;
+    }
+    else {
+        usage();
+        return (1);
+    }
+
+    if(((sizes = malloc(sizeof(uint32_t) * num_files)) == NULL) ||
+        ((buf = malloc(WBUF_SIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (1);
+    }
+
+    /* Pick sizes */
+    state = (seed == 0) ? 1 : seed;
+    for(i = 0 ; i < num_files ; i++) {
+        if(profile[0] == 't')
+            sizes[i] = next_random(&state) % ((uint64_t)max_size + 1);
+        else if(profile[0] == 'h')
+            sizes[i] = max_size;
+        else {
+            double r = (double)(next_random(&state) >> 11) /
+                (double)(UINT64_C(1) << 53);
+
+            sizes[i] = (uint32_t)exp(log(16.0) +
+                r * (log((double)max_size) - log(16.0)));
+        }
+        total += sizes[i];
+    }
+
+    if((out = fopen(argv[1], "wb")) == NULL) {
+        fprintf(stderr, "cannot create group archive : %s\n", argv[1]);
+        return (1);
+    }
+
+    /* Header and directory */
+    memcpy(buf, GRPHDR_MAGIC, GRPHDR_MAGICLEN);
+    put_le32(&buf[GRPHDR_MAGICLEN], num_files);
+    fwrite(buf, 1, GRPHDR_MAGICLEN + 4, out);
+    for(i = 0 ; i < num_files ; i++) {
+        memset(entry, 0, sizeof(entry));
+        snprintf((char *)entry, sizeof(entry), "F%07u.DAT", i % 10000000);
+        put_le32(&entry[GRPHDR_FILENAMELEN], sizes[i]);
+        fwrite(entry, 1, sizeof(entry), out);
+    }
+
+    /* Data */
+    for(i = 0 ; i < num_files ; i++) {
+        uint32_t remaining = sizes[i];
+
+        while(remaining > 0) {
+            uint32_t chunk = (remaining > WBUF_SIZE) ? WBUF_SIZE : remaining;
+            uint32_t j;
+
+            for(j = 0 ; j < chunk ; j += sizeof(uint64_t)) {
+                uint64_t r = next_random(&state);
+
+                memcpy(&buf[j], &r, (chunk - j < sizeof(uint64_t)) ?
+                    chunk - j : sizeof(uint64_t));
+            }
+            fwrite(buf, 1, chunk, out);
+            remaining -= chunk;
+        }
+    }
+
+    if(fclose(out) != 0) {
+        fprintf(stderr, "cannot write group archive : %s\n", argv[1]);
+        return (1);
+    }
+    fprintf(stdout, "%s : %u files, %llu bytes of data\n", argv[1],
+        num_files, (unsigned long long)total);
+
+    free(buf);
+    free(sizes);
+    return (0);
+}
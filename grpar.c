@@ -24,19 +24,10 @@
  * SUCH DAMAGE.
  */
 
-/*
-   Group file format, see : http://advsys.net/ken/build.htm
-   12 bytes : "KenSilverman"
-    4 bytes : number of files (little-endian)
-
-   Then, for each file :
-   12 bytes : file name (zero-filled)
-    4 bytes : file size (little-endian)
-
-   Then, for each file :
-    n bytes : file data
-    [...]
-*/
+#if defined(__linux__)
+  /* fallocate(2) */
+  #define _GNU_SOURCE
+#endif
 
 /* uint32_t, uint8_t */
 #include <stdint.h>
@@ -47,34 +38,77 @@
 /* malloc(3) */
 #include <stdlib.h>
 
-/* strncmp(3) */
+/* strlen(3) */
 #include <string.h>
 
+/* toupper(3) */
+#include <ctype.h>
+
 /* open(2) */
 #include <fcntl.h>
 
-/* read(2), getopt(3) */
+/* close(2), getopt_long(3) */
 #include <sys/types.h>
 #if defined(_WIN32)
-  #include <getopt.h>
+  #include <io.h>
 #else
-  #include <sys/uio.h>
   #include <unistd.h>
 #endif
-
-#if defined(__FreeBSD__)
-  /* le32toh(9) */
-  #include <sys/endian.h>
-#elif defined(__linux__)
-  /* le32toh(3) */
-  #include <endian.h>
-#else
-  #define le32toh(x) (x)
-#endif
+#include <getopt.h>
 
 /* stat(2) */
 #include <sys/stat.h>
 
+/* time(3) */
+#include <time.h>
+
+/* pthread_create(3) */
+#if !defined(_WIN32)
+  #include <pthread.h>
+  #define HAVE_PTHREAD
+#endif
+
+/* openat(2), fdopendir(3) */
+#if !defined(_WIN32)
+  #include <dirent.h>
+  #define HAVE_OPENAT
+#endif
+
+/* regcomp(3) */
+#if !defined(_WIN32)
+  #include <regex.h>
+  #define HAVE_REGEX
+#endif
+
+/* errno(2) */
+#include <errno.h>
+
+/* ioctl(FICLONE) */
+#if defined(__linux__)
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+#endif
+
+/* fallocate(2), posix_fallocate(2) */
+#if defined(__linux__)
+  #define HAVE_FALLOCATE
+#elif defined(__FreeBSD__)
+  #define HAVE_POSIX_FALLOCATE
+#endif
+
+/* Sparse files (pwrite(2), ftruncate(2)) */
+#if !defined(_WIN32)
+  #define HAVE_SPARSE
+#endif
+
+/* SSE2 instructions, for zero-scan */
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define HAVE_SSE2
+#endif
+
+#include "libgrp.h"
+
 /* Windows-Unix compat */
 #if !defined(O_BINARY)
   #define O_BINARY 0
@@ -82,264 +116,3303 @@
 #if !defined(S_ISDIR)
   #define S_ISDIR(mode)  (((mode) & S_IFMT) == S_IFDIR)
 #endif
+#if !defined(STDOUT_FILENO)
+  #define STDOUT_FILENO 1
+#endif
 
 #define GRPAR_VERSION       "0.2"
 
-#define GRPHDR_MAGIC        "KenSilverman"  /* magic */
-#define GRPHDR_MAGICLEN     12              /* magic length */
-#define GRPHDR_NUMFILESLEN  4               /* bytes for number of files */
-
-#define GRPHDR_FILENAMELEN  12              /* bytes for file name */
-#define GRPHDR_FILESIZELEN  4               /* bytes for file size */
-
-/* File entry within group archive */
-struct grp_file;
-struct grp_file {
-    uint32_t index;                         /* file position */
-    char file_name[GRPHDR_FILENAMELEN + 1]; /* file name + '\0' */
-    uint32_t file_size;                     /* file size in bytes */
-    off_t file_offset;                      /* file offset in group archive */
-    struct grp_file *next;                  /* next one */
-};
-
 /* Program options */
+#define MAX_THREADS     1024
 struct program_options {
-    char *grp_filename;
+    char **grp_filenames;                   /* -f archives, in order */
+    int num_grp_filenames;
     char *dst_dirname;
+    char *dst_filename;                     /* patched group archive */
 #define ACTION_NONE     0
 #define ACTION_LIST     1
 #define ACTION_EXTRACT  2
+#define ACTION_CREATE   3
+#define ACTION_APPEND   4
+#define ACTION_UPDATE   5
+#define ACTION_VERIFY   6
+#define ACTION_DIFF     7
+#define ACTION_MAKE_PATCH   8
+#define ACTION_APPLY_PATCH  9
     uint8_t action;
+    int open_flags;                         /* grp_open() flags */
+    unsigned int num_threads;
+    uint8_t uring;                          /* use io_uring(7) */
+    uint8_t dedup;                          /* link identical files */
+    uint8_t sparse;                         /* write zeros as holes */
+    char *store_dirname;                    /* dedup store directory */
+#define FORMAT_TEXT     0
+#define FORMAT_JSON     1
+#define FORMAT_CSV      2
+#define FORMAT_TSV      3
+#define FORMAT_NULL0    4
+    uint8_t format;                         /* listing format */
+#define OUTPUT_FILES    0
+#define OUTPUT_RAW      1
+#define OUTPUT_TAR      2
+    uint8_t output;                         /* extraction output */
+    char **includes;                        /* --include patterns */
+    int num_includes;
+    char **excludes;                        /* --exclude patterns */
+    int num_excludes;
+    uint8_t regex;                          /* patterns are regexes */
     uint8_t verbose;
 };
 
-/* Initialize grp_file structures from a grp file
-   Returns a file handle on group file as well as num_files found in archive */
+/* Listing formats, as given to --format */
+static const char *format_names[] = { "text", "json", "csv", "tsv", "null0" };
+#define NUM_FORMATS     (sizeof(format_names) / sizeof(format_names[0]))
+
+/* Long options */
+#define OPT_FORMAT      256
+#define OPT_INCLUDE     257
+#define OPT_EXCLUDE     258
+#define OPT_REGEX       259
+#define OPT_TO_TAR      260
+#define OPT_DIFF        261
+#define OPT_MAKE_PATCH  262
+#define OPT_APPLY_PATCH 263
+static const struct option long_options[] = {
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { "include", required_argument, NULL, OPT_INCLUDE },
+    { "exclude", required_argument, NULL, OPT_EXCLUDE },
+    { "regex", no_argument, NULL, OPT_REGEX },
+    { "to-tar", no_argument, NULL, OPT_TO_TAR },
+    { "diff", no_argument, NULL, OPT_DIFF },
+    { "make-patch", no_argument, NULL, OPT_MAKE_PATCH },
+    { "apply-patch", no_argument, NULL, OPT_APPLY_PATCH },
+    { NULL, 0, NULL, 0 }
+};
+
+/* Group archives given with -f, layered as the Build engine does with its
+   search path : a member shadows members of the same name found in
+   previous archives */
+struct layer {
+    const char *grp_filename;
+    struct grp_archive *archive;
+    const struct grp_file **files;          /* effective files, sorted by
+                                               offset (NULL meaning all) */
+    int64_t num_files;
+};
+
+/* Listing output buffer, written to standard output in large chunks
+   (machine-readable formats may list many entries) */
+#define OUTPUT_BUFSIZE  (1024 * 1024)
+#define OUTPUT_MAXENTRY 256                 /* max bytes per entry */
+struct output {
+    char *buf;
+    size_t len;                             /* bytes pending */
+    int error;                              /* write error occurred */
+};
+
+/* Write pending output
+   Returns 0 on success, -1 on error */
+static int
+flush_output(struct output *out)
+{
+    const char *p = out->buf;
+
+    while((out->len > 0) && !out->error) {
+        ssize_t bytes = write(STDOUT_FILENO, p, out->len);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            out->error = 1;
+            break;
+        }
+        p += bytes;
+        out->len -= bytes;
+    }
+    out->len = 0;
+    return (out->error ? -1 : 0);
+}
+
+/* Append a string to output */
+static void
+output_string(struct output *out, const char *s)
+{
+    while(*s != '\0')
+        out->buf[out->len++] = *s++;
+    return;
+}
+
+/* Append an unsigned integer to output, in decimal */
+static void
+output_uint(struct output *out, uint64_t value)
+{
+    char digits[20];                        /* UINT64_MAX */
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + (value % 10);
+        value /= 10;
+    } while(value != 0);
+    while(n > 0)
+        out->buf[out->len++] = digits[--n];
+    return;
+}
+
+/* Append a file name to output, quoted or escaped as format requires
+   (names are raw archive bytes : JSON escapes non-ASCII ones as latin-1
+   characters to remain valid UTF-8) */
+static void
+output_name(struct output *out, const char *name, uint8_t format)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p;
+
+    switch(format) {
+        case FORMAT_JSON:
+            out->buf[out->len++] = '"';
+            for(p = (const unsigned char *)name ; *p != '\0' ; p++) {
+                if((*p == '"') || (*p == '\\')) {
+                    out->buf[out->len++] = '\\';
+                    out->buf[out->len++] = *p;
+                }
+                else if((*p < 0x20) || (*p >= 0x7f)) {
+                    output_string(out, "\\u00");
+                    out->buf[out->len++] = hex[*p >> 4];
+                    out->buf[out->len++] = hex[*p & 0x0f];
+                }
+                else
+                    out->buf[out->len++] = *p;
+            }
+            out->buf[out->len++] = '"';
+            break;
+        case FORMAT_CSV:
+            /* RFC 4180 : quote fields holding separators or quotes */
+            if(strpbrk(name, ",\"\r\n") == NULL) {
+                output_string(out, name);
+                break;
+            }
+            out->buf[out->len++] = '"';
+            for(p = (const unsigned char *)name ; *p != '\0' ; p++) {
+                if(*p == '"')
+                    out->buf[out->len++] = '"';
+                out->buf[out->len++] = *p;
+            }
+            out->buf[out->len++] = '"';
+            break;
+        case FORMAT_TSV:
+            /* Tabs and newlines cannot appear in fields : escape them */
+            for(p = (const unsigned char *)name ; *p != '\0' ; p++) {
+                if((*p == '\t') || (*p == '\n') || (*p == '\r') ||
+                    (*p == '\\')) {
+                    out->buf[out->len++] = '\\';
+                    out->buf[out->len++] = (*p == '\t') ? 't' :
+                        (*p == '\n') ? 'n' : (*p == '\r') ? 'r' : '\\';
+                }
+                else
+                    out->buf[out->len++] = *p;
+            }
+            break;
+        default:
+            output_string(out, name);
+            break;
+    }
+    return;
+}
+
+/* Iterate over effective files of a layer
+   Returns file following current (first file if current is NULL), or NULL
+   after last file */
+static const struct grp_file *
+next_layer_file(const struct layer *layer, const struct grp_file *current,
+    int64_t *position)
+{
+    if(layer->files == NULL)
+        return (grp_next(layer->archive, current));
+    *position = (current == NULL) ? 0 : *position + 1;
+    return ((*position < layer->num_files) ? layer->files[*position] : NULL);
+}
+
+/* Dump grp_file structures in a machine-readable format : one record per
+   file (index, name, size and offset, plus archive when several are
+   layered), or NUL-terminated names only for FORMAT_NULL0 (e.g. for
+   xargs -0)
+   Returns 0 on success, -1 on error */
+static int
+dump_grp_files_formatted(const struct layer *layers, int num_layers,
+    uint8_t format)
+{
+    const struct grp_file *current;
+    struct output out;
+    const char *sep = (format == FORMAT_CSV) ? "," : "\t";
+    uint8_t first = 1;
+    int i;
+
+    if((out.buf = malloc(OUTPUT_BUFSIZE)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    out.len = 0;
+    out.error = 0;
+
+    /* Messages may have been printed already */
+    fflush(stdout);
+
+    if(format == FORMAT_JSON)
+        output_string(&out, "[");
+    else if((format == FORMAT_CSV) || (format == FORMAT_TSV)) {
+        if(num_layers > 1) {
+            output_string(&out, "archive");
+            output_string(&out, sep);
+        }
+        output_string(&out, "index");
+        output_string(&out, sep);
+        output_string(&out, "name");
+        output_string(&out, sep);
+        output_string(&out, "size");
+        output_string(&out, sep);
+        output_string(&out, "offset\n");
+    }
+
+    for(i = 0 ; (i < num_layers) && !out.error ; i++) {
+        const struct layer *layer = &layers[i];
+        /* Escaped archive name may take up to 6 bytes per character */
+        size_t reserve = OUTPUT_MAXENTRY +
+            ((num_layers > 1) ? 6 * strlen(layer->grp_filename) : 0);
+        int64_t position = 0;
+
+        if(reserve > OUTPUT_BUFSIZE / 2) {
+            fprintf(stderr, "group archive name too long : %s\n",
+                layer->grp_filename);
+            free(out.buf);
+            return (-1);
+        }
+
+        for(current = next_layer_file(layer, NULL, &position) ;
+            current != NULL ;
+            current = next_layer_file(layer, current, &position)) {
+            if((out.len > OUTPUT_BUFSIZE - reserve) &&
+                (flush_output(&out) < 0))
+                break;
+
+            switch(format) {
+                case FORMAT_JSON:
+                    output_string(&out, first ? "\n" : ",\n");
+                    output_string(&out, "{");
+                    if(num_layers > 1) {
+                        output_string(&out, "\"archive\":");
+                        output_name(&out, layer->grp_filename, format);
+                        output_string(&out, ",");
+                    }
+                    output_string(&out, "\"index\":");
+                    output_uint(&out, current->index);
+                    output_string(&out, ",\"name\":");
+                    output_name(&out, current->file_name, format);
+                    output_string(&out, ",\"size\":");
+                    output_uint(&out, current->file_size);
+                    output_string(&out, ",\"offset\":");
+                    output_uint(&out, current->file_offset);
+                    output_string(&out, "}");
+                    break;
+                case FORMAT_CSV:
+                case FORMAT_TSV:
+                    if(num_layers > 1) {
+                        output_name(&out, layer->grp_filename, format);
+                        output_string(&out, sep);
+                    }
+                    output_uint(&out, current->index);
+                    output_string(&out, sep);
+                    output_name(&out, current->file_name, format);
+                    output_string(&out, sep);
+                    output_uint(&out, current->file_size);
+                    output_string(&out, sep);
+                    output_uint(&out, current->file_offset);
+                    output_string(&out, "\n");
+                    break;
+                case FORMAT_NULL0:
+                    output_name(&out, current->file_name, format);
+                    out.buf[out.len++] = '\0';
+                    break;
+            }
+            first = 0;
+        }
+    }
+    if(format == FORMAT_JSON)
+        output_string(&out, "\n]\n");
+
+    flush_output(&out);
+    free(out.buf);
+    if(out.error) {
+        fprintf(stderr, "cannot write listing\n");
+        return (-1);
+    }
+    return (0);
+}
+
+/* Dump effective grp_file structures of layered archives, using given
+   listing format
+   Returns 0 on success, -1 on error */
+int
+dump_grp_files(const struct layer *layers, int num_layers, uint8_t format,
+    uint8_t verbose)
+{
+    const struct grp_file *current;
+    int i;
+
+    if(format != FORMAT_TEXT)
+        return (dump_grp_files_formatted(layers, num_layers, format));
+
+    for(i = 0 ; i < num_layers ; i++) {
+        int64_t position = 0;
+
+        for(current = next_layer_file(&layers[i], NULL, &position) ;
+            current != NULL ;
+            current = next_layer_file(&layers[i], current, &position)) {
+            if((verbose == 1) && (num_layers > 1))
+                fprintf(stdout, "%s (%u bytes, offset %llu (0x%llx), "
+                    "from %s)\n", current->file_name, current->file_size,
+                    (unsigned long long)current->file_offset,
+                    (unsigned long long)current->file_offset,
+                    layers[i].grp_filename);
+            else if(verbose == 1)
+                fprintf(stdout, "%s (%u bytes, offset %llu (0x%llx))\n",
+                    current->file_name, current->file_size,
+                    (unsigned long long)current->file_offset,
+                    (unsigned long long)current->file_offset);
+            else
+                fprintf(stdout, "%s\n", current->file_name);
+        }
+    }
+    return (0);
+}
+
+/* Destination directory, opened once so that files get created relative to
+   it without resolving its path again */
+struct dest_dir {
+    const char *path;                       /* directory path */
+    uint8_t sparse;                         /* write zeros as holes */
+#if defined(HAVE_OPENAT)
+    int handle;                             /* directory handle */
+#else
+    char *file_path;                        /* file path, reused */
+    size_t path_len;                        /* directory path length */
+#endif
+};
+
+/* Open destination directory
+   Returns 0 on success, -1 on error */
+int
+open_dest_dir(const char *path, struct dest_dir *dir)
+{
+    dir->path = path;
+    dir->sparse = 0;
+#if defined(HAVE_OPENAT)
+    if((dir->handle = open(path, O_RDONLY|O_DIRECTORY)) < 0) {
+        fprintf(stderr, "cannot open destination directory : %s\n", path);
+        return (-1);
+    }
+#else
+    /* File paths are built into a single buffer (extraction is serial) */
+    dir->path_len = strlen(path);
+    if((dir->file_path = malloc(dir->path_len + 1 + GRP_FILENAMELEN + 1))
+        == NULL) { /* includes '/' and final '\0' */
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    strcpy(dir->file_path, path);
+    strcat(dir->file_path, "/");
+#endif
+    return (0);
+}
+
+/* Close destination directory */
+void
+close_dest_dir(struct dest_dir *dir)
+{
+#if defined(HAVE_OPENAT)
+    close(dir->handle);
+    dir->handle = -1;
+#else
+    free(dir->file_path);
+    dir->file_path = NULL;
+#endif
+    return;
+}
+
+/* Create (or truncate) a file within destination directory
+   Returns a file handle or -1 on error */
+static int
+create_dest_file(const struct dest_dir *dir, const char *file_name)
+{
+#if defined(HAVE_OPENAT)
+    return (openat(dir->handle, file_name, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY,
+        0660));
+#else
+    if(strlen(file_name) > GRP_FILENAMELEN)
+        return (-1);
+    strcpy(&dir->file_path[dir->path_len + 1], file_name);
+    return (open(dir->file_path, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0660));
+#endif
+}
+
+/* Reserve space for size bytes in a new file, so that big files written
+   concurrently get contiguous extents (a hint : errors are ignored)
+   File size grows as data gets written, unless file is to be sparse (holes
+   can only be punched within file size) */
+#define PREALLOC_MINSIZE    (256 * 1024)    /* smallest file preallocated */
+static void
+preallocate_file(int handle, uint64_t size, uint8_t sparse)
+{
+#if defined(HAVE_FALLOCATE)
+    fallocate(handle, sparse ? 0 : FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(HAVE_POSIX_FALLOCATE)
+    /* Space allocated cannot be punched out */
+    if(!sparse)
+        posix_fallocate(handle, 0, size);
+#else
+    (void)handle;
+    (void)size;
+    (void)sparse;
+#endif
+    return;
+}
+
+#if defined(HAVE_SPARSE)
+/* Sparse files : blocks of zeros are not written (and punched out of
+   preallocated space), leaving holes, file size being set last (trailing
+   zeros, or truncated archive) */
+#define SPARSE_BLOCKSIZE    4096            /* hole granularity */
+#define SPARSE_BUFSIZE      (1024 * 1024)   /* multiple of SPARSE_BLOCKSIZE */
+
+/* Tell if size bytes of buf are all zeros, checking 64 bytes at a time
+   (SSE2 if available) */
+static int
+is_zero_block(const char *buf, size_t size)
+{
+    size_t i = 0;
+
+#if defined(HAVE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+
+    for( ; size - i >= 64 ; i += 64) {
+        __m128i acc = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+            _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+            _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return (0);
+    }
+#else
+    for( ; size - i >= 64 ; i += 64) {
+        uint64_t words[8];
+        uint64_t acc;
+
+        memcpy(words, buf + i, 64);
+        acc = words[0] | words[1] | words[2] | words[3] | words[4] |
+            words[5] | words[6] | words[7];
+        if(acc != 0)
+            return (0);
+    }
+#endif
+    for( ; i < size ; i++) {
+        if(buf[i] != 0)
+            return (0);
+    }
+    return (1);
+}
+
+/* Write size bytes of buf at offset (a multiple of SPARSE_BLOCKSIZE),
+   skipping runs of zero blocks
+   Returns 0 on success, -1 on error */
+static int
+write_sparse_data(int handle, const char *buf, size_t size, uint64_t offset)
+{
+    size_t pos = 0;
+
+    while(pos < size) {
+        size_t end = pos + ((size - pos > SPARSE_BLOCKSIZE) ?
+            SPARSE_BLOCKSIZE : size - pos);
+        int zero = is_zero_block(buf + pos, end - pos);
+
+        /* Gather a run of blocks of the same kind */
+        while(end < size) {
+            size_t block = (size - end > SPARSE_BLOCKSIZE) ?
+                SPARSE_BLOCKSIZE : size - end;
+
+            if(is_zero_block(buf + end, block) != zero)
+                break;
+            end += block;
+        }
+
+        if(zero) {
+#if defined(HAVE_FALLOCATE)
+            fallocate(handle, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                offset + pos, end - pos);
+#endif
+            pos = end;
+            continue;
+        }
+        while(pos < end) {
+            ssize_t bytes = pwrite(handle, buf + pos, end - pos,
+                offset + pos);
+
+            if(bytes < 0) {
+                if(errno == EINTR)
+                    continue;
+                return (-1);
+            }
+            pos += bytes;
+        }
+    }
+    return (0);
+}
+
+/* Copy a file to handle (a new file), as a sparse file, updating *crc
+   with its data if crc is not NULL
+   Returns the number of bytes copied (less than file size if archive is
+   truncated) or -1 on error */
+static int64_t
+copy_sparse_file(struct grp_archive *archive, const struct grp_file *file,
+    int handle, uint32_t *crc)
+{
+    char *buf;
+    uint64_t done = 0;
+
+    if((buf = malloc(SPARSE_BUFSIZE)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    while(done < file->file_size) {
+        size_t fill = 0;
+
+        /* Fill buffer, keeping offsets aligned on blocks */
+        while((fill < SPARSE_BUFSIZE) && (done + fill < file->file_size)) {
+            ssize_t bytes = grp_pread(archive, file, buf + fill,
+                SPARSE_BUFSIZE - fill, done + fill);
+
+            if(bytes < 0) {
+                if(errno == EINTR)
+                    continue;
+                free(buf);
+                return (-1);
+            }
+            if(bytes == 0)
+                break;
+            fill += bytes;
+        }
+        if(fill == 0)
+            break;
+        if(crc != NULL)
+            *crc = grp_crc32c(*crc, buf, fill);
+        if(write_sparse_data(handle, buf, fill, done) < 0) {
+            free(buf);
+            return (-1);
+        }
+        done += fill;
+        if(fill < SPARSE_BUFSIZE)
+            break;
+    }
+    free(buf);
+
+    /* Trailing zeros have not been written */
+    if(ftruncate(handle, done) < 0)
+        return (-1);
+    return (done);
+}
+#endif
+
+/* Copy a file to handle through buf (of bufsize bytes), computing its
+   CRC32C into *crc on the way
+   Returns the number of bytes copied (less than file size if archive is
+   truncated) or -1 on error */
+static int64_t
+copy_checksum_file(struct grp_archive *archive, const struct grp_file *file,
+    int handle, char *buf, size_t bufsize, uint32_t *crc)
+{
+    uint64_t done = 0;
+
+    while(done < file->file_size) {
+        ssize_t bytes = grp_pread(archive, file, buf, bufsize, done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        if(bytes == 0)
+            break;
+        *crc = grp_crc32c(*crc, buf, bytes);
+        if(grp_write_full(handle, buf, bytes) < 0)
+            return (-1);
+        done += bytes;
+    }
+    return (done);
+}
+
+/* Extract a single file from group archive into destination directory,
+   as dest_filename
+   If crc is not NULL, file data goes through buf (of bufsize bytes) and
+   its CRC32C is computed into *crc on the way */
+static int
+extract_file(struct grp_archive *archive, const struct grp_file *current,
+    const struct dest_dir *dir, const char *dest_filename, char *buf,
+    size_t bufsize, uint32_t *crc, uint8_t verbose)
+{
+    const char *strategy_name;
+    int dest_file_handle;
+    int64_t copied;
+    int strategy;
+
+    if((archive == NULL) || (current == NULL) || (dir == NULL) ||
+        (dest_filename == NULL)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    /* Open output file */
+    if((dest_file_handle = create_dest_file(dir, dest_filename)) < 0) {
+        fprintf(stderr, "cannot create destination file : %s/%s\n",
+            dir->path, dest_filename);
+        return (-1);
+    }
+
+    if(current->file_size >= PREALLOC_MINSIZE)
+        preallocate_file(dest_file_handle, current->file_size, dir->sparse);
+
+    /* Copy file to destination */
+    if(crc != NULL)
+        *crc = 0;
+#if defined(HAVE_SPARSE)
+    if(dir->sparse) {
+        copied = copy_sparse_file(archive, current, dest_file_handle, crc);
+        strategy_name = "sparse";
+    }
+    else
+#endif
+    if(crc != NULL) {
+        copied = copy_checksum_file(archive, current, dest_file_handle, buf,
+            bufsize, crc);
+        strategy_name = "checksummed";
+    }
+    else {
+        copied = grp_extract_fd(archive, current, dest_file_handle,
+            &strategy);
+        strategy_name = grp_strategy_name(strategy);
+    }
+    if(copied < 0) {
+        fprintf(stderr, "incomplete write to destination file : "
+            "%s/%s\n", dir->path, dest_filename);
+        close(dest_file_handle);
+        return (-1);
+    }
+
+    /* Has whole file been copied ? */
+    if(copied < current->file_size) {
+        fprintf(stderr, "file partially extracted : %s\n",
+            current->file_name);
+#if defined(HAVE_FALLOCATE)
+        /* Release space preallocated beyond data */
+        if(current->file_size >= PREALLOC_MINSIZE)
+            ftruncate(dest_file_handle, copied);
+#endif
+        close(dest_file_handle);
+        return (-1);
+    }
+
+    if(verbose == 1)
+        fprintf(stdout, "%s (%s)\n", current->file_name, strategy_name);
+
+    close(dest_file_handle);
+    return (0);
+}
+
+/* Extract a single file from group archive into destination directory,
+   as dest_filename */
+int
+extract_single_file(struct grp_archive *archive,
+    const struct grp_file *current, const struct dest_dir *dir,
+    const char *dest_filename, uint8_t verbose)
+{
+    return (extract_file(archive, current, dir, dest_filename, NULL, 0, NULL,
+        verbose));
+}
+
+/* Deduplicating extraction : files whose content has already been
+   extracted (during this run or into store directory) are reflinked (or
+   hardlinked if reflinks are unsupported) instead of being written again
+   Candidates are files of the same size (and CRC32C, once known), compared
+   byte by byte ; store files are named after their CRC32C and size, and
+   listed once, when deduplication state is initialized */
+struct dedup_entry {
+    uint8_t used;                           /* slot in use */
+    uint32_t crc;                           /* CRC32C of file */
+    uint32_t size;                          /* size of file */
+    const struct grp_file *file;            /* file, as extracted, or NULL
+                                               for a store file */
+};
+struct dedup {
+    const char *store_path;                 /* store directory or NULL */
+    int store_handle;                       /* store directory handle */
+    struct dedup_entry *entries;            /* open addressing table, by
+                                               file size */
+    uint32_t mask;                          /* table size - 1 */
+    char *buf;                              /* archive data buffer */
+    char *cmp_buf;                          /* existing file data buffer */
+    uint8_t reflink;                        /* cleared once reflinks turn
+                                               out to be unsupported */
+};
+#define DEDUP_BUFSIZE   (1024 * 1024)
+#define DEDUP_NAMELEN   (8 + 1 + 10)        /* crc-size */
+
+#if defined(HAVE_OPENAT)
+/* Link strategies */
+#define LINK_REFLINK    0                   /* ioctl(FICLONE) */
+#define LINK_HARDLINK   1                   /* linkat(2) */
+static const char *link_strategy_names[] = { "reflink", "hardlink" };
+
+/* Un-initialize deduplication state */
+void
+uninit_dedup(struct dedup *dedup)
+{
+    if(dedup->store_handle >= 0)
+        close(dedup->store_handle);
+    dedup->store_handle = -1;
+    free(dedup->entries);
+    free(dedup->buf);
+    free(dedup->cmp_buf);
+    dedup->entries = NULL;
+    dedup->buf = dedup->cmp_buf = NULL;
+    return;
+}
+
+/* First table slot for files of size bytes */
+static uint32_t
+dedup_slot(const struct dedup *dedup, uint32_t size)
+{
+    uint32_t hash = size * UINT32_C(2654435761);
+
+    return ((hash ^ (hash >> 16)) & dedup->mask);
+}
+
+/* Remember a file (within this run if file is not NULL, or within store
+   directory) of size bytes and CRC32C crc */
+static void
+add_dedup_entry(struct dedup *dedup, uint32_t crc, uint32_t size,
+    const struct grp_file *file)
+{
+    uint32_t slot;
+
+    for(slot = dedup_slot(dedup, size) ; dedup->entries[slot].used ;
+        slot = (slot + 1) & dedup->mask)
+        ;
+    dedup->entries[slot].used = 1;
+    dedup->entries[slot].crc = crc;
+    dedup->entries[slot].size = size;
+    dedup->entries[slot].file = file;
+    return;
+}
+
+/* Parse a store file name
+   Returns 0 on success, -1 if name is not a store file name */
+static int
+parse_store_name(const char *name, uint32_t *crc, uint32_t *size)
+{
+    char check[DEDUP_NAMELEN + 1];
+    unsigned int name_crc, name_size;
+
+    if(sscanf(name, "%8x-%10u", &name_crc, &name_size) != 2)
+        return (-1);
+    snprintf(check, sizeof(check), "%08x-%u", name_crc, name_size);
+    if(strcmp(check, name) != 0)
+        return (-1);
+    *crc = name_crc;
+    *size = name_size;
+    return (0);
+}
+
+/* Initialize deduplication state, for num_files files (from one or more
+   archives), with an optional store directory
+   Returns 0 on success, -1 on error */
 int
-init_grp_files(const char *filename, struct grp_file **head,
-    uint32_t *num_files)
+init_dedup(int64_t num_files, const char *store_path, struct dedup *dedup)
+{
+    DIR *store_dir = NULL;
+    struct dirent *entry;
+    int64_t num_entries = num_files;
+    uint32_t crc, file_size;
+    uint32_t size = 1;
+
+    dedup->store_path = store_path;
+    dedup->store_handle = -1;
+    dedup->entries = NULL;
+    dedup->buf = dedup->cmp_buf = NULL;
+    dedup->reflink = 1;
+
+    /* Count store files */
+    if(store_path != NULL) {
+        int dir_handle;
+
+        if(((dedup->store_handle = open(store_path, O_RDONLY|O_DIRECTORY))
+            < 0) || ((dir_handle = dup(dedup->store_handle)) < 0)) {
+            fprintf(stderr, "cannot open store directory : %s\n",
+                store_path);
+            uninit_dedup(dedup);
+            return (-1);
+        }
+        if((store_dir = fdopendir(dir_handle)) == NULL) {
+            fprintf(stderr, "cannot read store directory : %s\n",
+                store_path);
+            close(dir_handle);
+            uninit_dedup(dedup);
+            return (-1);
+        }
+        while((entry = readdir(store_dir)) != NULL) {
+            if(parse_store_name(entry->d_name, &crc, &file_size) == 0)
+                num_entries++;
+        }
+    }
+
+    /* Keep load factor below 1/2 */
+    while((size < 2 * num_entries) && (size < (UINT32_C(1) << 31)))
+        size <<= 1;
+    dedup->mask = size - 1;
+
+    if(((dedup->entries = calloc(size, sizeof(struct dedup_entry))) == NULL) ||
+        ((dedup->buf = malloc(DEDUP_BUFSIZE)) == NULL) ||
+        ((dedup->cmp_buf = malloc(DEDUP_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        if(store_dir != NULL)
+            closedir(store_dir);
+        uninit_dedup(dedup);
+        return (-1);
+    }
+
+    /* Remember store files */
+    if(store_dir != NULL) {
+        rewinddir(store_dir);
+        while(((entry = readdir(store_dir)) != NULL) &&
+            (num_entries > num_files)) {
+            if(parse_store_name(entry->d_name, &crc, &file_size) == 0) {
+                add_dedup_entry(dedup, crc, file_size, NULL);
+                num_entries--;
+            }
+        }
+        closedir(store_dir);
+    }
+    return (0);
+}
+
+/* Tell if file dir_handle/name holds the same data as file (within
+   archive)
+   If crc is not NULL, file is read to its end whatever the outcome, and its
+   CRC32C is computed into *crc
+   Returns 1 if data is the same, 0 if not, -1 if file could not be read
+   entirely (truncated archive) */
+static int
+same_file_data(struct grp_archive *archive, const struct grp_file *file,
+    struct dedup *dedup, int dir_handle, const char *name, uint32_t *crc)
 {
-    int grp_file_handle;
+    struct stat file_stat;
+    uint64_t done = 0;
+    int handle;
+    int same;
+
+    if(((handle = openat(dir_handle, name, O_RDONLY)) >= 0) &&
+        ((fstat(handle, &file_stat) < 0) || !S_ISREG(file_stat.st_mode) ||
+        ((uint64_t)file_stat.st_size != file->file_size))) {
+        close(handle);
+        handle = -1;
+    }
+    same = (handle >= 0);
+    if(crc != NULL)
+        *crc = 0;
+    else if(!same)
+        return (0);
+
+    while(done < file->file_size) {
+        ssize_t bytes = grp_pread(archive, file, dedup->buf, DEDUP_BUFSIZE,
+            done);
+
+        if(bytes <= 0)
+            break;
+        if(same &&
+            ((pread(handle, dedup->cmp_buf, bytes, done) != bytes) ||
+            (memcmp(dedup->buf, dedup->cmp_buf, bytes) != 0))) {
+            same = 0;
+            if(crc == NULL) {
+                close(handle);
+                return (0);
+            }
+        }
+        if(crc != NULL)
+            *crc = grp_crc32c(*crc, dedup->buf, bytes);
+        done += bytes;
+    }
+
+    if(handle >= 0)
+        close(handle);
+    if(done < file->file_size)
+        return (-1);
+    return (same);
+}
+
+/* Make dst_dir_handle/dst_name (not existing) share
+   src_dir_handle/src_name's data, as a reflink if possible or a hardlink
+   Returns link strategy used or -1 on error */
+static int
+link_file(struct dedup *dedup, int src_dir_handle, const char *src_name,
+    int dst_dir_handle, const char *dst_name)
+{
+#if defined(FICLONE)
+    if(dedup->reflink) {
+        int src_handle, dst_handle;
+        int ret;
+        int error;
+
+        if((src_handle = openat(src_dir_handle, src_name, O_RDONLY)) < 0)
+            return (-1);
+        if((dst_handle = openat(dst_dir_handle, dst_name,
+            O_WRONLY|O_CREAT|O_EXCL, 0660)) < 0) {
+            close(src_handle);
+            return (-1);
+        }
+        ret = ioctl(dst_handle, FICLONE, src_handle);
+        error = errno;
+        close(src_handle);
+        close(dst_handle);
+        if(ret == 0)
+            return (LINK_REFLINK);
+        unlinkat(dst_dir_handle, dst_name, 0);
+
+        /* Not supported by file system (or across file systems) */
+        if((error == EOPNOTSUPP) || (error == ENOTTY) || (error == EINVAL))
+            dedup->reflink = 0;
+        else if(error != EXDEV) {
+            errno = error;
+            return (-1);
+        }
+    }
+#endif
+
+    if(linkat(src_dir_handle, src_name, dst_dir_handle, dst_name, 0) < 0)
+        return (-1);
+    return (LINK_HARDLINK);
+}
+
+/* Extract a single file from group archive, unless its data has already
+   been extracted, in which case it is linked to that copy
+   File data is read once : compared to candidates (files of the same size)
+   until one matches, or checksummed while being extracted if there are no
+   candidates (candidates that do not match are checksummed against, the
+   file then being read a second time to be extracted)
+   Archive must not be read forward only
+   Returns 0 on success, -1 on error */
+static int
+extract_dedup_file(struct grp_archive *archive,
+    const struct grp_file *current, const struct dest_dir *dir,
+    struct dedup *dedup, uint8_t verbose)
+{
+    char store_name[DEDUP_NAMELEN + 1];
+    uint32_t crc;
+    uint32_t slot;
+    int has_crc = 0;
+    int strategy;
+
+    /* Destination may be linked to a store file or to another member (by a
+       previous run), that must be kept */
+    if((unlinkat(dir->handle, current->file_name, 0) < 0) &&
+        (errno != ENOENT)) {
+        fprintf(stderr, "cannot replace destination file : %s/%s\n",
+            dir->path, current->file_name);
+        return (-1);
+    }
+
+    /* Empty files are not worth it */
+    if(current->file_size == 0)
+        return (extract_single_file(archive, current, dir,
+            current->file_name, verbose));
+
+    /* Already extracted (during this run or into store) ? */
+    for(slot = dedup_slot(dedup, current->file_size) ;
+        dedup->entries[slot].used ; slot = (slot + 1) & dedup->mask) {
+        const struct dedup_entry *entry = &dedup->entries[slot];
+        int src_handle;
+        const char *src_name;
+        int same;
+
+        if((entry->size != current->file_size) ||
+            (has_crc && (entry->crc != crc)))
+            continue;
+        if(entry->file != NULL) {
+            /* (a previous file with the same name has just been
+               overwritten) */
+            if(strcmp(entry->file->file_name, current->file_name) == 0)
+                continue;
+            src_handle = dir->handle;
+            src_name = entry->file->file_name;
+        }
+        else {
+            snprintf(store_name, sizeof(store_name), "%08x-%u", entry->crc,
+                entry->size);
+            src_handle = dedup->store_handle;
+            src_name = store_name;
+        }
+
+        if((same = same_file_data(archive, current, dedup, src_handle,
+            src_name, has_crc ? NULL : &crc)) < 0)
+            /* Truncated archive */
+            return (extract_single_file(archive, current, dir,
+                current->file_name, verbose));
+        has_crc = 1;
+        if(same && ((strategy = link_file(dedup, src_handle, src_name,
+            dir->handle, current->file_name)) >= 0))
+            goto linked;
+    }
+
+    /* New data : extract it (checksumming it on the way, unless already
+       done), then remember it */
+    if(has_crc) {
+        if(extract_single_file(archive, current, dir, current->file_name,
+            verbose) < 0)
+            return (-1);
+    }
+    else if(extract_file(archive, current, dir, current->file_name,
+        dedup->buf, DEDUP_BUFSIZE, &crc, verbose) < 0)
+        return (-1);
+
+    if(dedup->store_handle >= 0) {
+        snprintf(store_name, sizeof(store_name), "%08x-%u", crc,
+            current->file_size);
+        link_file(dedup, dir->handle, current->file_name,
+            dedup->store_handle, store_name);
+    }
+    add_dedup_entry(dedup, crc, current->file_size, current);
+    return (0);
+
+linked:
+    if(verbose == 1)
+        fprintf(stdout, "%s (%s)\n", current->file_name,
+            link_strategy_names[strategy]);
+    return (0);
+}
+#endif
+
+#if defined(HAVE_PTHREAD)
+/* Work queue shared by extraction threads */
+struct extract_queue {
+    struct grp_archive *archive;
+    const struct dest_dir *dir;
+    uint8_t verbose;
+    const struct grp_file **files;          /* files to extract */
+    uint32_t num_files;                     /* number of files to extract */
+    uint32_t next;                          /* next file to pick */
+    pthread_mutex_t lock;                   /* protects next */
+};
+
+/* Sort files by decreasing size */
+static int
+compare_file_sizes(const void *a, const void *b)
+{
+    const struct grp_file *fa = *(const struct grp_file * const *)a;
+    const struct grp_file *fb = *(const struct grp_file * const *)b;
+
+    if(fa->file_size != fb->file_size)
+        return ((fa->file_size < fb->file_size) ? 1 : -1);
+    return ((fa->index < fb->index) ? -1 : 1);
+}
+
+/* Extraction thread : pick files from queue until it is empty
+   Returns (void *)-1 if an error occurred */
+static void *
+extract_worker(void *arg)
+{
+    struct extract_queue *queue = arg;
+    const struct grp_file *current;
+    int err = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&queue->lock);
+        current = (queue->next < queue->num_files) ?
+            queue->files[queue->next++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        if(current == NULL)
+            break;
+        err |= extract_single_file(queue->archive, current, queue->dir,
+            current->file_name, queue->verbose);
+    }
+    return ((err != 0) ? (void *)-1 : NULL);
+}
+
+/* Extract files of at least min_size bytes from group archive using
+   num_threads threads
+   Biggest files are handed out first so that threads finish together */
+static int
+extract_all_files_parallel(struct grp_archive *archive,
+    const struct dest_dir *dir, const struct grp_file **files,
+    uint32_t num_files, uint32_t min_size, unsigned int num_threads,
+    uint8_t verbose)
+{
+    struct extract_queue queue;
+    pthread_t *threads;
+    unsigned int started = 0;
+    unsigned int t;
+    uint32_t i;
+    void *ret;
+    int err = 0;
+
+    if((queue.files = malloc(sizeof(struct grp_file *) * num_files))
+        == NULL ||
+        (threads = malloc(sizeof(pthread_t) * num_threads)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(queue.files);
+        return (-1);
+    }
+    queue.num_files = 0;
+    for(i = 0 ; i < num_files ; i++) {
+        if(files[i]->file_size >= min_size)
+            queue.files[queue.num_files++] = files[i];
+    }
+    qsort(queue.files, queue.num_files, sizeof(struct grp_file *),
+        &compare_file_sizes);
+
+    queue.archive = archive;
+    queue.dir = dir;
+    queue.verbose = verbose;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    /* Current thread is the last worker */
+    for(t = 0 ; t < num_threads - 1 ; t++) {
+        if(pthread_create(&threads[started], NULL, &extract_worker, &queue)
+            == 0)
+            started++;
+    }
+    if(extract_worker(&queue) != NULL)
+        err = -1;
+    for(t = 0 ; t < started ; t++) {
+        pthread_join(threads[t], &ret);
+        if(ret != NULL)
+            err = -1;
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    free(threads);
+    free(queue.files);
+    return (err);
+}
+#endif
+
+#if defined(HAVE_OPENAT)
+/* Extract files small enough for io_uring(7), all at once
+   Returns 0 on success, -1 on error */
+static int
+extract_small_files(struct grp_archive *archive, const struct dest_dir *dir,
+    const struct grp_file **files, uint32_t num_files, uint8_t verbose)
+{
+    const struct grp_file **small_files;
+    uint32_t num_small_files = 0;
+    uint32_t i;
+    int err;
+
+    if((small_files = malloc(sizeof(struct grp_file *) * num_files))
+        == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    for(i = 0 ; i < num_files ; i++) {
+        if(files[i]->file_size <= GRP_URING_MAXSIZE)
+            small_files[num_small_files++] = files[i];
+    }
+    err = grp_extract_uring(archive, small_files, num_small_files,
+        dir->handle, (verbose == 1) ? GRP_VERBOSE : 0);
+    free(small_files);
+    return (err);
+}
+#endif
+
+/* Tell the kernel how archive will be read to extract files (sorted by
+   offset) : whole archive will be read once, from start to end, unless
+   only some files are picked here and there ; then, ask for read-ahead of
+   each span of adjacent ones */
+static void
+advise_files(struct grp_archive *archive, const struct grp_file **files,
+    uint32_t num_files)
+{
+    uint32_t first = 0;
+    uint32_t i;
+
+    if(num_files == grp_num_files(archive)) {
+        grp_advise(archive, NULL, GRP_ADVICE_SEQUENTIAL);
+        return;
+    }
+
+    grp_advise(archive, NULL, GRP_ADVICE_RANDOM);
+    for(i = 1 ; i <= num_files ; i++) {
+        if((i == num_files) || (files[i]->file_offset !=
+            files[i - 1]->file_offset + files[i - 1]->file_size)) {
+            grp_advise_span(archive, files[first], files[i - 1],
+                GRP_ADVICE_WILLNEED);
+            first = i;
+        }
+    }
+    return;
+}
+
+/* Coalesced extraction : runs of small files adjacent in archive are read
+   at once, then split out to their destination files */
+#define COALESCE_MAXSIZE    (256 * 1024)    /* biggest file coalesced */
+#define COALESCE_BUFSIZE    (4 * 1024 * 1024) /* max bytes per read */
+
+/* Write a file already read into buf (available bytes of it, less than
+   its size if archive is truncated) into destination directory
+   Returns 0 on success, -1 on error */
+static int
+extract_buffered_file(const struct grp_file *current,
+    const struct dest_dir *dir, const char *buf, size_t available,
+    uint8_t verbose)
+{
+    int dest_file_handle;
+
+    if((dest_file_handle = create_dest_file(dir, current->file_name)) < 0) {
+        fprintf(stderr, "cannot create destination file : %s/%s\n",
+            dir->path, current->file_name);
+        return (-1);
+    }
+#if defined(HAVE_SPARSE)
+    if(dir->sparse ? ((write_sparse_data(dest_file_handle, buf, available,
+        0) < 0) || (ftruncate(dest_file_handle, available) < 0)) :
+        (grp_write_full(dest_file_handle, buf, available) < 0)) {
+#else
+    if(grp_write_full(dest_file_handle, buf, available) < 0) {
+#endif
+        fprintf(stderr, "incomplete write to destination file : "
+            "%s/%s\n", dir->path, current->file_name);
+        close(dest_file_handle);
+        return (-1);
+    }
+    close(dest_file_handle);
+
+    if(available < current->file_size) {
+        fprintf(stderr, "file partially extracted : %s\n",
+            current->file_name);
+        return (-1);
+    }
+    if(verbose == 1)
+        fprintf(stdout, "%s (coalesced)\n", current->file_name);
+    return (0);
+}
+
+/* Extract files (sorted by offset) of at least min_size bytes, one at a
+   time, small adjacent ones being read at once
+   Returns 0 on success, -1 on error */
+static int
+extract_coalesced_files(struct grp_archive *archive,
+    const struct dest_dir *dir, const struct grp_file **files,
+    uint32_t num_files, uint32_t min_size, uint8_t verbose)
+{
+    char *buf;
+    uint32_t i = 0;
+    int err = 0;
+
+    if((buf = malloc(COALESCE_BUFSIZE)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+
+    while(i < num_files) {
+        const struct grp_file *first = files[i];
+        uint64_t span_size = first->file_size;
+        uint32_t n = 1;
+        ssize_t bytes;
+        uint32_t j;
+
+        if(first->file_size < min_size) {
+            i++;
+            continue;
+        }
+
+        /* Gather following small files, as long as they are adjacent */
+        while((first->file_size <= COALESCE_MAXSIZE) && (i + n < num_files) &&
+            (files[i + n]->file_size <= COALESCE_MAXSIZE) &&
+            (files[i + n]->file_size >= min_size) &&
+            (files[i + n]->file_offset == first->file_offset + span_size) &&
+            (span_size + files[i + n]->file_size <= COALESCE_BUFSIZE)) {
+            span_size += files[i + n]->file_size;
+            n++;
+        }
+        if(n == 1) {
+            err |= extract_single_file(archive, first, dir, first->file_name,
+                verbose);
+            i++;
+            continue;
+        }
+
+        /* Single read, split out to each file */
+        if((bytes = grp_pread_archive(archive, buf, span_size,
+            first->file_offset)) < 0)
+            bytes = 0;
+        for(j = 0 ; j < n ; j++) {
+            const struct grp_file *current = files[i + j];
+            uint64_t offset = current->file_offset - first->file_offset;
+            size_t available = ((uint64_t)bytes <= offset) ? 0 :
+                ((uint64_t)bytes - offset < current->file_size) ?
+                (size_t)(bytes - offset) : current->file_size;
+
+            err |= extract_buffered_file(current, dir, buf + offset,
+                available, verbose);
+        }
+        i += n;
+    }
+    free(buf);
+    return (err);
+}
+
+/* Extract a batch of files (sorted by offset), or all files if files is
+   NULL, from group archive into destination directory, using num_threads
+   threads, small files going through io_uring(7) if uring is set
+   If dedup is not NULL, files are extracted one at a time, duplicates being
+   linked instead */
+int
+extract_all_files(struct grp_archive *archive, const struct dest_dir *dir,
+    const struct grp_file **files, uint32_t num_files, struct dedup *dedup,
+    unsigned int num_threads, uint8_t uring, uint8_t verbose)
+{
+    const struct grp_file **all_files = NULL;
+    const struct grp_file *current;
+    uint32_t min_size = 0;                  /* smaller files already done */
+    uint32_t i;
+    int err = 0;
+
+    if((archive == NULL) || (dir == NULL)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    if(files == NULL) {
+        if((all_files = malloc(sizeof(struct grp_file *) *
+            (grp_num_files(archive) + 1))) == NULL) {
+            fprintf(stderr, "cannot allocate memory\n");
+            return (-1);
+        }
+        num_files = 0;
+        for(current = grp_next(archive, NULL) ; current != NULL ;
+            current = grp_next(archive, current))
+            all_files[num_files++] = current;
+        files = all_files;
+    }
+
+    advise_files(archive, files, num_files);
+
+#if defined(HAVE_OPENAT)
+    if((dedup != NULL) && !grp_is_streaming(archive)) {
+        for(i = 0 ; i < num_files ; i++)
+            err |= extract_dedup_file(archive, files[i], dir, dedup,
+                verbose);
+        goto end;
+    }
+
+    if((uring == 1) && !grp_is_streaming(archive)) {
+        err |= extract_small_files(archive, dir, files, num_files, verbose);
+        min_size = GRP_URING_MAXSIZE + 1;
+    }
+#endif
+
+#if defined(HAVE_PTHREAD)
+    /* Forward-only archives must be read in order */
+    if((num_threads > 1) && (num_files > 1) && !grp_is_streaming(archive)) {
+        err |= extract_all_files_parallel(archive, dir, files, num_files,
+            min_size, (num_threads > num_files) ? num_files : num_threads,
+            verbose);
+        goto end;
+    }
+#endif
+
+    /* Regular reads : coalesce them */
+    if(!grp_is_mapped(archive) && !grp_is_streaming(archive)) {
+        err |= extract_coalesced_files(archive, dir, files, num_files,
+            min_size, verbose);
+        goto end;
+    }
+
+    for(i = 0 ; i < num_files ; i++) {
+        if(files[i]->file_size < min_size)
+            continue;
+        err |= extract_single_file(archive, files[i], dir,
+            files[i]->file_name, verbose);
+        /* A forward-only archive cannot be read past a failed member */
+        if((err != 0) && grp_is_streaming(archive))
+            break;
+    }
+
+end:
+    free(all_files);
+    return (err);
+}
+
+/* Standard output extraction : raw file data (-O) or a POSIX ustar stream
+   (--to-tar), archive data being copied in-kernel (sendfile(2), splice(2))
+   when possible */
+#define TAR_BLOCKSIZE   512
+
+/* Build ustar header of file into block (regular file, mode 0644, owned by
+   root, dated mtime) */
+static void
+make_tar_header(char *block, const struct grp_file *file, time_t mtime)
+{
+    unsigned int sum = 0;
+    int i;
+
+    memset(block, 0, TAR_BLOCKSIZE);
+    strncpy(&block[0], file->file_name, 100);           /* name */
+    snprintf(&block[100], 8, "%07o", 0644);             /* mode */
+    snprintf(&block[108], 8, "%07o", 0);                /* uid */
+    snprintf(&block[116], 8, "%07o", 0);                /* gid */
+    snprintf(&block[124], 12, "%011o", file->file_size); /* size */
+    snprintf(&block[136], 12, "%011llo",                /* mtime */
+        (unsigned long long)((mtime > 0) ? mtime : 0) & 077777777777ULL);
+    block[156] = '0';                                   /* typeflag */
+    memcpy(&block[257], "ustar", 6);                    /* magic */
+    memcpy(&block[263], "00", 2);                       /* version */
+    strcpy(&block[265], "root");                        /* uname */
+    strcpy(&block[297], "root");                        /* gname */
+
+    /* Checksum, computed with its own field filled with spaces */
+    memset(&block[148], ' ', 8);
+    for(i = 0 ; i < TAR_BLOCKSIZE ; i++)
+        sum += (unsigned char)block[i];
+    snprintf(&block[148], 8, "%06o", sum);
+    block[155] = ' ';
+    return;
+}
+
+/* Write files (sorted by offset) to standard output, raw or as tar
+   stream members (output being OUTPUT_RAW or OUTPUT_TAR)
+   Verbose messages go to standard error
+   Returns 0 on success, -1 on error */
+int
+output_all_files(struct grp_archive *archive, const struct grp_file **files,
+    uint32_t num_files, uint8_t output, uint8_t verbose)
+{
+    char block[TAR_BLOCKSIZE];
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    time_t mtime = (epoch != NULL) ? (time_t)strtoll(epoch, NULL, 10) :
+        time(NULL);
+    uint32_t i;
+    int err = 0;
+
+    advise_files(archive, files, num_files);
+    fflush(stdout);
+
+    for(i = 0 ; i < num_files ; i++) {
+        const struct grp_file *current = files[i];
+        uint64_t padding;
+        int64_t copied;
+        int strategy;
+
+        if(output == OUTPUT_TAR) {
+            make_tar_header(block, current, mtime);
+            if(grp_write_full(STDOUT_FILENO, block, TAR_BLOCKSIZE) < 0)
+                goto write_error;
+        }
+
+        if((copied = grp_extract_fd(archive, current, STDOUT_FILENO,
+            &strategy)) < 0)
+            goto write_error;
+        if(copied < current->file_size) {
+            fprintf(stderr, "file partially extracted : %s\n",
+                current->file_name);
+            err = -1;
+        }
+
+        /* Pad file to its announced size, then to a whole block */
+        if(output == OUTPUT_TAR) {
+            padding = (current->file_size - copied) +
+                ((TAR_BLOCKSIZE - (current->file_size % TAR_BLOCKSIZE)) %
+                TAR_BLOCKSIZE);
+            memset(block, 0, TAR_BLOCKSIZE);
+            while(padding > 0) {
+                size_t chunk = (padding > TAR_BLOCKSIZE) ?
+                    TAR_BLOCKSIZE : (size_t)padding;
+
+                if(grp_write_full(STDOUT_FILENO, block, chunk) < 0)
+                    goto write_error;
+                padding -= chunk;
+            }
+        }
+
+        if(verbose == 1)
+            fprintf(stderr, "%s (%s)\n", current->file_name,
+                grp_strategy_name(strategy));
+    }
+    return (err);
+
+write_error:
+    fprintf(stderr, "cannot write to standard output\n");
+    return (-1);
+}
+
+/* End tar stream written by output_all_files() : two zero blocks
+   Returns 0 on success, -1 on error */
+int
+end_tar_output(void)
+{
+    char block[TAR_BLOCKSIZE];
+
+    memset(block, 0, TAR_BLOCKSIZE);
+    if((grp_write_full(STDOUT_FILENO, block, TAR_BLOCKSIZE) < 0) ||
+        (grp_write_full(STDOUT_FILENO, block, TAR_BLOCKSIZE) < 0)) {
+        fprintf(stderr, "cannot write to standard output\n");
+        return (-1);
+    }
+    return (0);
+}
+
+/* Member selection patterns : exact names, glob patterns or extended
+   regular expressions, all matched case-insensitively (as the Build engine
+   does), selecting members or excluding them */
+#define PATTERN_NAME    0
+#define PATTERN_GLOB    1
+#define PATTERN_REGEX   2
+struct pattern {
+    const char *text;
+    uint8_t type;                           /* PATTERN_* */
+    uint8_t exclude;                        /* excludes matching members */
+    uint32_t matches;                       /* number of members matched */
+#if defined(HAVE_REGEX)
+    regex_t regex;                          /* compiled PATTERN_REGEX */
+#endif
+};
+struct selection {
+    struct pattern *patterns;
+    int num_patterns;                       /* patterns compiled */
+    int num_includes;                       /* non-excluding patterns */
+};
+
+/* Match a single character against glob pattern element (character, ?
+   or [...] class), case-insensitively
+   Returns pointer to next pattern element or NULL if c does not match */
+static const char *
+match_glob_char(const char *pattern, unsigned char c)
+{
+    const char *p = pattern + 1;
+    int negate = 0;
+    int found = 0;
+
+    if(*pattern == '?')
+        return (p);
+    if(*pattern != '[')
+        return ((toupper((unsigned char)*pattern) == toupper(c)) ? p : NULL);
+
+    /* Class, ']' first being part of it ; unterminated means literal '[' */
+    if((*p == '!') || (*p == '^')) {
+        negate = 1;
+        p++;
+    }
+    do {
+        unsigned char lo = *p;
+        unsigned char hi = *p;
+
+        if(*p == '\0')
+            return ((c == '[') ? pattern + 1 : NULL);
+        if((p[1] == '-') && (p[2] != ']') && (p[2] != '\0')) {
+            hi = p[2];
+            p += 2;
+        }
+        if(((c >= lo) && (c <= hi)) ||
+            ((toupper(c) >= lo) && (toupper(c) <= hi)) ||
+            ((tolower(c) >= lo) && (tolower(c) <= hi)))
+            found = 1;
+        p++;
+    } while(*p != ']');
+    return ((found != negate) ? p + 1 : NULL);
+}
+
+/* Match name against glob pattern (*, ? and [...] classes, negated by a
+   leading ! or ^)
+   Returns 1 if name matches */
+static int
+match_glob(const char *pattern, const char *name)
+{
+    const char *star_pattern = NULL;        /* after last '*' */
+    const char *star_name = NULL;           /* where it started matching */
+    const char *next;
+
+    while(*name != '\0') {
+        if(*pattern == '*') {
+            star_pattern = ++pattern;
+            star_name = name;
+            continue;
+        }
+        if((*pattern != '\0') &&
+            ((next = match_glob_char(pattern, *name)) != NULL)) {
+            pattern = next;
+            name++;
+            continue;
+        }
+        /* Let last '*' swallow one more character */
+        if(star_pattern == NULL)
+            return (0);
+        pattern = star_pattern;
+        name = ++star_name;
+    }
+    while(*pattern == '*')
+        pattern++;
+    return (*pattern == '\0');
+}
+
+/* Un-initialize member selection */
+void
+uninit_selection(struct selection *selection)
+{
+#if defined(HAVE_REGEX)
+    int i;
+
+    for(i = 0 ; i < selection->num_patterns ; i++) {
+        if(selection->patterns[i].type == PATTERN_REGEX)
+            regfree(&selection->patterns[i].regex);
+    }
+#endif
+    free(selection->patterns);
+    selection->patterns = NULL;
+    selection->num_patterns = selection->num_includes = 0;
+    return;
+}
+
+/* Add a pattern to member selection, compiling it once
+   Returns 0 on success, -1 on error */
+static int
+add_selection_pattern(struct selection *selection, const char *text,
+    uint8_t exclude, uint8_t regex)
+{
+    struct pattern *pattern = &selection->patterns[selection->num_patterns];
+
+    pattern->text = text;
+    pattern->exclude = exclude;
+    pattern->matches = 0;
+    if(regex) {
+#if defined(HAVE_REGEX)
+        int ret;
+
+        if((ret = regcomp(&pattern->regex, text,
+            REG_EXTENDED|REG_ICASE|REG_NOSUB)) != 0) {
+            char errbuf[128];
+
+            regerror(ret, &pattern->regex, errbuf, sizeof(errbuf));
+            fprintf(stderr, "invalid regular expression : %s (%s)\n", text,
+                errbuf);
+            return (-1);
+        }
+        pattern->type = PATTERN_REGEX;
+#else
+        fprintf(stderr, "regular expressions not supported\n");
+        return (-1);
+#endif
+    }
+    else
+        pattern->type = (strpbrk(text, "*?[") != NULL) ? PATTERN_GLOB :
+            PATTERN_NAME;
+
+    selection->num_patterns++;
+    if(!exclude)
+        selection->num_includes++;
+    return (0);
+}
+
+/* Initialize member selection from names and patterns given as arguments,
+   --include and --exclude patterns
+   Returns 0 on success, -1 on error */
+int
+init_selection(struct selection *selection, char **args, int num_args,
+    const struct program_options *options)
+{
+    int i;
+
+    selection->num_patterns = selection->num_includes = 0;
+    if((selection->patterns = malloc(sizeof(struct pattern) *
+        (num_args + options->num_includes + options->num_excludes + 1))) ==
+        NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    for(i = 0 ; i < num_args ; i++) {
+        if(add_selection_pattern(selection, args[i], 0, options->regex) < 0)
+            goto error;
+    }
+    for(i = 0 ; i < options->num_includes ; i++) {
+        if(add_selection_pattern(selection, options->includes[i], 0,
+            options->regex) < 0)
+            goto error;
+    }
+    for(i = 0 ; i < options->num_excludes ; i++) {
+        if(add_selection_pattern(selection, options->excludes[i], 1,
+            options->regex) < 0)
+            goto error;
+    }
+    return (0);
+
+error:
+    uninit_selection(selection);
+    return (-1);
+}
+
+/* Tell if pattern matches file name */
+static int
+match_pattern(const struct pattern *pattern, const char *name)
+{
+    switch(pattern->type) {
+        case PATTERN_GLOB:
+            return (match_glob(pattern->text, name));
+#if defined(HAVE_REGEX)
+        case PATTERN_REGEX:
+            return (regexec(&pattern->regex, name, 0, NULL, 0) == 0);
+#endif
+        default:
+            return (0);
+    }
+}
+
+/* Tell if a file named name is found in (later) layers
+   Returns 1 if so, 0 otherwise */
+static int
+is_shadowed(const char *name, const struct layer *layers, int num_layers)
+{
+    int i;
+
+    for(i = 0 ; i < num_layers ; i++) {
+        if(grp_lookup(layers[i].archive, name) != NULL)
+            return (1);
+    }
+    return (0);
+}
+
+/* Select files from group archive, skipping files shadowed by later
+   layers : exact names are looked up through the name index, then
+   remaining patterns are matched in a single pass over the TOC
+   Fills files (to be freed by caller) with selected files, sorted by
+   offset (i.e. in archive order)
+   Returns the number of files selected or -1 on error */
+#define SELECT_NAMED    0x01                /* matched by an exact name */
+#define SELECT_EXCLUDED 0x02                /* excluded by an exact name */
+int64_t
+select_files(struct grp_archive *archive, const struct layer *later,
+    int num_later, struct selection *selection,
+    const struct grp_file ***files)
+{
+    const struct grp_file *current;
+    uint8_t *named;
+    uint32_t num_files = 0;
+    int i;
+
+    if(((*files = malloc(sizeof(struct grp_file *) *
+        (grp_num_files(archive) + 1))) == NULL) ||
+        ((named = calloc(grp_num_files(archive) + 1, sizeof(uint8_t))) ==
+        NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(*files);
+        *files = NULL;
+        return (-1);
+    }
+
+    for(i = 0 ; i < selection->num_patterns ; i++) {
+        struct pattern *pattern = &selection->patterns[i];
+
+        if((pattern->type == PATTERN_NAME) &&
+            ((current = grp_lookup(archive, pattern->text)) != NULL)) {
+            named[current->index - 1] |=
+                pattern->exclude ? SELECT_EXCLUDED : SELECT_NAMED;
+            pattern->matches++;
+        }
+    }
+
+    for(current = grp_next(archive, NULL) ; current != NULL ;
+        current = grp_next(archive, current)) {
+        uint8_t included = (selection->num_includes == 0) ||
+            (named[current->index - 1] & SELECT_NAMED);
+        uint8_t excluded = (named[current->index - 1] & SELECT_EXCLUDED);
+
+        /* Overridden by a later archive : never touched */
+        if((num_later > 0) &&
+            is_shadowed(current->file_name, later, num_later))
+            continue;
+
+        for(i = 0 ; (i < selection->num_patterns) && !excluded ; i++) {
+            struct pattern *pattern = &selection->patterns[i];
+
+            /* Including patterns still get checked until they match, so
+               that they do not get reported as matching nothing */
+            if((pattern->type == PATTERN_NAME) ||
+                (!pattern->exclude && included && (pattern->matches > 0)))
+                continue;
+            if(match_pattern(pattern, current->file_name)) {
+                pattern->matches++;
+                if(pattern->exclude)
+                    excluded = 1;
+                else
+                    included = 1;
+            }
+        }
+        if(included && !excluded)
+            (*files)[num_files++] = current;
+    }
+
+    free(named);
+    return (num_files);
+}
+
+/* Select effective files of layered archives from names and patterns given
+   as arguments and options, each archive in turn
+   Fills layers' files (to be freed by caller), unless a single archive is
+   given and all its files are selected while all is set (files being then
+   left NULL), and reports patterns matching nothing
+   Returns the total number of files selected or -1 on error */
+int64_t
+select_layer_files(struct layer *layers, int num_layers, char **args,
+    int num_args, const struct program_options *options, uint8_t all)
+{
+    struct selection selection;
+    int64_t num_files = 0;
+    int i;
+
+    if(all && (num_layers == 1) && (num_args <= 0) &&
+        (options->num_includes <= 0) && (options->num_excludes <= 0)) {
+        layers[0].num_files = grp_num_files(layers[0].archive);
+        return (layers[0].num_files);
+    }
+
+    if(init_selection(&selection, args, num_args, options) < 0)
+        return (-1);
+    for(i = 0 ; i < num_layers ; i++) {
+        if((layers[i].num_files = select_files(layers[i].archive,
+            &layers[i + 1], num_layers - i - 1, &selection,
+            &layers[i].files)) < 0) {
+            uninit_selection(&selection);
+            return (-1);
+        }
+        num_files += layers[i].num_files;
+    }
+
+    for(i = 0 ; i < selection.num_patterns ; i++) {
+        if(!selection.patterns[i].exclude &&
+            (selection.patterns[i].matches == 0))
+            fprintf(stderr, "%s : not found in group archive\n",
+                selection.patterns[i].text);
+    }
+    uninit_selection(&selection);
+    return (num_files);
+}
+
+/* Verify group archive : check that TOC fits within archive, then print
+   CRC32C of each file, reading archive sequentially
+   Returns 0 if archive is sound, -1 otherwise */
+#define VERIFY_BUFSIZE  (1024 * 1024)
+int
+verify_all_files(struct grp_archive *archive, uint8_t verbose)
+{
+    const struct grp_file *current;
+    int64_t archive_size;
+    int64_t checked;
+    uint32_t crc;
+    char *buf = NULL;
+    int err = 0;
+
+    if(archive == NULL) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    /* Archive size is unknown when reading from standard input, truncated
+       files being then reported while reading them */
+    if((archive_size = grp_archive_size(archive)) >= 0) {
+        for(current = grp_next(archive, NULL) ; current != NULL ;
+            current = grp_next(archive, current)) {
+            if(current->file_offset + current->file_size >
+                (uint64_t)archive_size) {
+                fprintf(stderr, "%s : beyond end of group archive (offset "
+                    "%llu, %u bytes, archive is %lld bytes)\n",
+                    current->file_name,
+                    (unsigned long long)current->file_offset,
+                    current->file_size, (long long)archive_size);
+                err = -1;
+            }
+        }
+    }
+
+    if(!grp_is_mapped(archive) && ((buf = malloc(VERIFY_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+
+    /* Whole archive will be read once, from start to end */
+    grp_advise(archive, NULL, GRP_ADVICE_SEQUENTIAL);
+
+    for(current = grp_next(archive, NULL) ; current != NULL ;
+        current = grp_next(archive, current)) {
+        if((checked = grp_checksum(archive, current, buf, VERIFY_BUFSIZE,
+            &crc)) < 0) {
+            fprintf(stderr, "cannot read member data : %s\n",
+                current->file_name);
+            err = -1;
+            /* A forward-only archive cannot be read past a failed member */
+            if(grp_is_streaming(archive))
+                break;
+            continue;
+        }
+        if(checked < current->file_size) {
+            fprintf(stderr, "file truncated : %s (%lld of %u bytes)\n",
+                current->file_name, (long long)checked, current->file_size);
+            err = -1;
+            continue;
+        }
+        if(verbose == 1)
+            fprintf(stdout, "%08x %s (%u bytes)\n", crc, current->file_name,
+                current->file_size);
+        else
+            fprintf(stdout, "%08x %s\n", crc, current->file_name);
+    }
+
+    free(buf);
+    return (err);
+}
+
+/* Content hashing (XXH64 algorithm), used to compare files of two archives
+   without holding both in memory : data is hashed by 32-byte stripes, then
+   remaining bytes are folded into the final value */
+#define HASH64_PRIME1   UINT64_C(0x9e3779b185ebca87)
+#define HASH64_PRIME2   UINT64_C(0xc2b2ae3d27d4eb4f)
+#define HASH64_PRIME3   UINT64_C(0x165667b19e3779f9)
+#define HASH64_PRIME4   UINT64_C(0x85ebca77c2b2ae63)
+#define HASH64_PRIME5   UINT64_C(0x27d4eb2f165667c5)
+#define HASH64_STRIPE   32
+struct hash64 {
+    uint64_t acc[4];                        /* stripe accumulators */
+    uint64_t total;                         /* bytes hashed */
+};
+
+/* Read a little-endian 64-bit / 32-bit value */
+static inline uint64_t
+read_le64(const unsigned char *p)
+{
+    return ((uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+        ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+        ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+        ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56));
+}
+
+static inline uint32_t
+read_le32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static inline uint64_t
+rotl64(uint64_t value, int bits)
+{
+    return ((value << bits) | (value >> (64 - bits)));
+}
+
+static inline uint64_t
+hash64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * HASH64_PRIME2;
+    return (rotl64(acc, 31) * HASH64_PRIME1);
+}
+
+static inline uint64_t
+hash64_merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= hash64_round(0, acc);
+    return (hash * HASH64_PRIME1 + HASH64_PRIME4);
+}
+
+/* Initialize hash state */
+static void
+hash64_init(struct hash64 *state)
+{
+    state->acc[0] = HASH64_PRIME1 + HASH64_PRIME2;
+    state->acc[1] = HASH64_PRIME2;
+    state->acc[2] = 0;
+    state->acc[3] = -HASH64_PRIME1;
+    state->total = 0;
+    return;
+}
+
+/* Hash whole stripes of size bytes from buf
+   Returns the number of bytes hashed (remaining ones are to be given to
+   hash64_final()) */
+static size_t
+hash64_update(struct hash64 *state, const unsigned char *buf, size_t size)
+{
+    size_t done = 0;
+
+    for( ; size - done >= HASH64_STRIPE ; done += HASH64_STRIPE) {
+        state->acc[0] = hash64_round(state->acc[0], read_le64(buf + done));
+        state->acc[1] = hash64_round(state->acc[1],
+            read_le64(buf + done + 8));
+        state->acc[2] = hash64_round(state->acc[2],
+            read_le64(buf + done + 16));
+        state->acc[3] = hash64_round(state->acc[3],
+            read_le64(buf + done + 24));
+    }
+    state->total += done;
+    return (done);
+}
+
+/* Hash last bytes (less than a stripe) from buf
+   Returns final hash value */
+static uint64_t
+hash64_final(struct hash64 *state, const unsigned char *buf, size_t size)
+{
+    uint64_t hash;
+
+    if(state->total >= HASH64_STRIPE) {
+        hash = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) +
+            rotl64(state->acc[2], 12) + rotl64(state->acc[3], 18);
+        hash = hash64_merge(hash, state->acc[0]);
+        hash = hash64_merge(hash, state->acc[1]);
+        hash = hash64_merge(hash, state->acc[2]);
+        hash = hash64_merge(hash, state->acc[3]);
+    }
+    else
+        hash = HASH64_PRIME5;
+    hash += state->total + size;
+
+    for( ; size >= 8 ; buf += 8, size -= 8) {
+        hash ^= hash64_round(0, read_le64(buf));
+        hash = rotl64(hash, 27) * HASH64_PRIME1 + HASH64_PRIME4;
+    }
+    if(size >= 4) {
+        hash ^= (uint64_t)read_le32(buf) * HASH64_PRIME1;
+        hash = rotl64(hash, 23) * HASH64_PRIME2 + HASH64_PRIME3;
+        buf += 4;
+        size -= 4;
+    }
+    for( ; size > 0 ; buf++, size--) {
+        hash ^= *buf * HASH64_PRIME5;
+        hash = rotl64(hash, 11) * HASH64_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH64_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH64_PRIME3;
+    hash ^= hash >> 32;
+    return (hash);
+}
+
+/* Hash state for data given in chunks of any size */
+struct hash64_stream {
+    struct hash64 state;
+    unsigned char pending[HASH64_STRIPE];   /* bytes not hashed yet */
+    size_t pending_len;
+};
+
+/* Initialize hash stream */
+static void
+hash64_stream_init(struct hash64_stream *stream)
+{
+    hash64_init(&stream->state);
+    stream->pending_len = 0;
+    return;
+}
+
+/* Hash size bytes from buf */
+static void
+hash64_stream_update(struct hash64_stream *stream, const unsigned char *buf,
+    size_t size)
+{
+    size_t done;
+
+    /* Complete pending stripe first */
+    if(stream->pending_len > 0) {
+        size_t fill = HASH64_STRIPE - stream->pending_len;
+
+        if(fill > size)
+            fill = size;
+        memcpy(stream->pending + stream->pending_len, buf, fill);
+        stream->pending_len += fill;
+        buf += fill;
+        size -= fill;
+        if(stream->pending_len < HASH64_STRIPE)
+            return;
+        hash64_update(&stream->state, stream->pending, HASH64_STRIPE);
+        stream->pending_len = 0;
+    }
+    done = hash64_update(&stream->state, buf, size);
+    memcpy(stream->pending, buf + done, size - done);
+    stream->pending_len = size - done;
+    return;
+}
+
+/* Returns final hash value */
+static uint64_t
+hash64_stream_final(struct hash64_stream *stream)
+{
+    return (hash64_final(&stream->state, stream->pending,
+        stream->pending_len));
+}
+
+/* Compute a file's hash into *hash, reading it through buf (buf_size
+   bytes, a multiple of HASH64_STRIPE)
+   Returns the number of bytes hashed (less than file size if archive is
+   truncated) or -1 on error */
+static int64_t
+hash_file(struct grp_archive *archive, const struct grp_file *file,
+    unsigned char *buf, size_t buf_size, uint64_t *hash)
+{
+    struct hash64 state;
+    uint64_t done = 0;
+    size_t fill = 0;
+    size_t hashed = 0;
+
+    hash64_init(&state);
+    while(done < file->file_size) {
+        ssize_t bytes;
+
+        /* Fill buffer, so that only last chunk leaves bytes unhashed */
+        fill = hashed = 0;
+        while((fill < buf_size) && (done + fill < file->file_size)) {
+            if((bytes = grp_pread(archive, file, buf + fill,
+                buf_size - fill, done + fill)) < 0) {
+                if(errno == EINTR)
+                    continue;
+                return (-1);
+            }
+            if(bytes == 0)
+                break;
+            fill += bytes;
+        }
+        if(fill == 0)
+            break;
+        hashed = hash64_update(&state, buf, fill);
+        done += fill;
+        if(fill < buf_size)
+            break;
+    }
+    *hash = hash64_final(&state, buf + hashed, fill - hashed);
+    return (done);
+}
+
+/* Archive comparison : files are matched by name (case-insensitively, a
+   name being bound to its first file as for lookups), then files of the
+   same size are compared through their hash, each archive being read
+   once, in offset order */
+#define DIFF_SKIPPED    0                   /* duplicate name, ignored */
+#define DIFF_SAME       1
+#define DIFF_REMOVED    2
+#define DIFF_CHANGED    3
+#define DIFF_HASHED     4                   /* same size, hash pending */
+#define DIFF_BUFSIZE    (1024 * 1024)       /* multiple of HASH64_STRIPE */
+
+/* Append a difference record to output : status (A for added, D for
+   removed, M for changed) and file name */
+static void
+output_difference(struct output *out, char status, const char *name,
+    uint8_t format, uint8_t *first)
+{
+    char status_string[2] = { status, '\0' };
+    const char *sep = (format == FORMAT_CSV) ? "," : "\t";
+
+    switch(format) {
+        case FORMAT_JSON:
+            output_string(out, *first ? "\n" : ",\n");
+            output_string(out, "{\"status\":\"");
+            output_string(out, status_string);
+            output_string(out, "\",\"name\":");
+            output_name(out, name, format);
+            output_string(out, "}");
+            break;
+        case FORMAT_NULL0:
+            output_string(out, status_string);
+            output_string(out, "\t");
+            output_string(out, name);
+            out->buf[out->len++] = '\0';
+            break;
+        default:
+            output_string(out, status_string);
+            output_string(out, sep);
+            output_name(out, name, (format == FORMAT_TEXT) ?
+                FORMAT_TSV : format);
+            output_string(out, "\n");
+            break;
+    }
+    *first = 0;
+    return;
+}
+
+/* Compare old_archive and new_archive, filling status (one entry per old
+   file, zeroed by caller) with DIFF_* values and, if old_hashes is not
+   NULL, old_hashes (one entry per old file) with hashes of old files
+   compared through their hash
+   Returns 0 on success, -1 on error */
+static int
+compare_archives(struct grp_archive *old_archive,
+    struct grp_archive *new_archive, uint8_t *status, uint64_t *old_hashes)
+{
+    const struct grp_file *current;
+    const struct grp_file *old_file;
+    const struct grp_file **files = NULL;
+    uint64_t *hashes = old_hashes;
+    unsigned char *buf = NULL;
+    uint32_t num_files;
+    uint32_t i;
+    int64_t bytes;
+    int err = 0;
+
+    if(((files = malloc(sizeof(struct grp_file *) *
+        ((grp_num_files(old_archive) > grp_num_files(new_archive) ?
+        grp_num_files(old_archive) : grp_num_files(new_archive)) + 1))) ==
+        NULL) ||
+        ((hashes == NULL) && ((hashes = malloc(sizeof(uint64_t) *
+        (grp_num_files(old_archive) + 1))) == NULL)) ||
+        ((buf = malloc(DIFF_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        err = -1;
+        goto cleanup;
+    }
+
+    /* Compare TOCs : old files missing from new archive or of a different
+       size are known without reading them */
+    num_files = 0;
+    for(current = grp_next(old_archive, NULL) ; current != NULL ;
+        current = grp_next(old_archive, current)) {
+        const struct grp_file *new_file;
+
+        if(grp_lookup(old_archive, current->file_name) != current)
+            continue;
+        if((new_file = grp_lookup(new_archive, current->file_name)) == NULL)
+            status[current->index - 1] = DIFF_REMOVED;
+        else if(new_file->file_size != current->file_size)
+            status[current->index - 1] = DIFF_CHANGED;
+        else {
+            status[current->index - 1] = DIFF_HASHED;
+            files[num_files++] = current;
+        }
+    }
+
+    /* Hash remaining old files, in offset order */
+    advise_files(old_archive, files, num_files);
+    for(i = 0 ; i < num_files ; i++) {
+        if((bytes = hash_file(old_archive, files[i], buf, DIFF_BUFSIZE,
+            &hashes[files[i]->index - 1])) < files[i]->file_size) {
+            fprintf(stderr, "%s : %s\n", (bytes < 0) ?
+                "cannot read member data" : "file truncated",
+                files[i]->file_name);
+            err = -1;
+            goto cleanup;
+        }
+    }
+
+    /* Then their new counterparts, in (new archive) offset order */
+    num_files = 0;
+    for(current = grp_next(new_archive, NULL) ; current != NULL ;
+        current = grp_next(new_archive, current)) {
+        if((grp_lookup(new_archive, current->file_name) == current) &&
+            ((old_file = grp_lookup(old_archive, current->file_name)) !=
+            NULL) && (status[old_file->index - 1] == DIFF_HASHED))
+            files[num_files++] = current;
+    }
+    advise_files(new_archive, files, num_files);
+    for(i = 0 ; i < num_files ; i++) {
+        uint64_t hash;
+
+        if((bytes = hash_file(new_archive, files[i], buf, DIFF_BUFSIZE,
+            &hash)) < files[i]->file_size) {
+            fprintf(stderr, "%s : %s\n", (bytes < 0) ?
+                "cannot read member data" : "file truncated",
+                files[i]->file_name);
+            err = -1;
+            goto cleanup;
+        }
+        old_file = grp_lookup(old_archive, files[i]->file_name);
+        status[old_file->index - 1] =
+            (hash == hashes[old_file->index - 1]) ? DIFF_SAME : DIFF_CHANGED;
+    }
+
+cleanup:
+    free(buf);
+    if(hashes != old_hashes)
+        free(hashes);
+    free(files);
+    return (err);
+}
+
+/* Print files added to, removed from or changed between old_archive and
+   new_archive, using given listing format
+   Returns the number of differences found or -1 on error */
+int64_t
+diff_archives(struct grp_archive *old_archive,
+    struct grp_archive *new_archive, uint8_t format)
+{
+    const struct grp_file *current;
+    uint8_t *status;
+    struct output out;
+    uint8_t first = 1;
+    int64_t num_differences = 0;
+
+    out.buf = NULL;
+    if(((status = calloc(grp_num_files(old_archive) + 1, sizeof(uint8_t))) ==
+        NULL) || ((out.buf = malloc(OUTPUT_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(status);
+        return (-1);
+    }
+    out.len = 0;
+    out.error = 0;
+
+    if(compare_archives(old_archive, new_archive, status, NULL) < 0) {
+        free(out.buf);
+        free(status);
+        return (-1);
+    }
+
+    /* Report removed and changed files (in old archive order), then added
+       ones (in new archive order) */
+    fflush(stdout);
+    if(format == FORMAT_JSON)
+        output_string(&out, "[");
+    else if((format == FORMAT_CSV) || (format == FORMAT_TSV))
+        output_string(&out, (format == FORMAT_CSV) ? "status,name\n" :
+            "status\tname\n");
+    for(current = grp_next(old_archive, NULL) ; current != NULL ;
+        current = grp_next(old_archive, current)) {
+        if((status[current->index - 1] != DIFF_REMOVED) &&
+            (status[current->index - 1] != DIFF_CHANGED))
+            continue;
+        if((out.len > OUTPUT_BUFSIZE - OUTPUT_MAXENTRY) &&
+            (flush_output(&out) < 0))
+            break;
+        output_difference(&out,
+            (status[current->index - 1] == DIFF_REMOVED) ? 'D' : 'M',
+            current->file_name, format, &first);
+        num_differences++;
+    }
+    for(current = grp_next(new_archive, NULL) ; current != NULL ;
+        current = grp_next(new_archive, current)) {
+        if((grp_lookup(new_archive, current->file_name) != current) ||
+            (grp_lookup(old_archive, current->file_name) != NULL))
+            continue;
+        if((out.len > OUTPUT_BUFSIZE - OUTPUT_MAXENTRY) &&
+            (flush_output(&out) < 0))
+            break;
+        output_difference(&out, 'A', current->file_name, format, &first);
+        num_differences++;
+    }
+    if(format == FORMAT_JSON)
+        output_string(&out, "\n]\n");
+
+    flush_output(&out);
+    free(out.buf);
+    free(status);
+    if(out.error) {
+        fprintf(stderr, "cannot write listing\n");
+        return (-1);
+    }
+    return (num_differences);
+}
+
+/* Delta patches : a patch rebuilds new archive from old one. It holds new
+   archive's TOC followed by, for each of its files, operations producing
+   its data : copies of old archive data (a whole unchanged file, or blocks
+   of a changed one found through a rolling checksum, as rsync(1) does) or
+   literal data. Integers are little-endian :
+
+     "GRPPATCH", u32 version, u32 old number of files, u64 old TOC hash,
+     u32 new number of files, new TOC (u8[12] name, u32 size per file),
+     then, per new file, operations until its size is reached :
+       u8 PATCH_CHECK, u32 old file index (from 1), u64 old file hash
+       u8 PATCH_COPY, u32 old file index (from 1), u32 offset, u32 length
+       u8 PATCH_DATA, u32 length, data
+     then u64 new archive hash
+
+   An old file is checked (PATCH_CHECK, preceding its first copy) before
+   any of its data is copied, and the new archive is checked once rebuilt,
+   so that a patch applied to an archive whose data (rather than TOC)
+   differs from the one it has been made against gets rejected */
+#define PATCH_MAGIC         "GRPPATCH"
+#define PATCH_MAGICLEN      8
+#define PATCH_HEADERLEN     (PATCH_MAGICLEN + 4 + 4 + 8 + 4)
+#define PATCH_VERSION       2
+#define PATCH_COPY          0
+#define PATCH_DATA          1
+#define PATCH_CHECK         2
+#define PATCH_COPYLEN       (1 + 4 + 4 + 4)
+#define PATCH_DATALEN       (1 + 4)
+#define PATCH_CHECKLEN      (1 + 4 + 8)
+#define PATCH_TRAILERLEN    8
+#define PATCH_TOCENTRYLEN   16
+#define PATCH_BLOCKSIZE     1024            /* delta block size */
+#define PATCH_BUFSIZE       (1024 * 1024)
+
+/* Write a little-endian 64-bit / 32-bit value */
+static inline void
+write_le64(unsigned char *p, uint64_t value)
+{
+    int i;
+
+    for(i = 0 ; i < 8 ; i++)
+        p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline void
+write_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+/* Hash archive's TOC (names and sizes, as stored in archive), identifying
+   the archive a patch applies to
+   Returns TOC hash */
+static uint64_t
+hash_toc(const struct grp_archive *archive)
+{
+    const struct grp_file *current;
+    unsigned char buf[PATCH_TOCENTRYLEN * 256];
+    struct hash64 state;
+    size_t fill = 0;
+    size_t hashed;
+
+    hash64_init(&state);
+    for(current = grp_next(archive, NULL) ; current != NULL ;
+        current = grp_next(archive, current)) {
+        memset(&buf[fill], 0, PATCH_TOCENTRYLEN - 4);
+        memcpy(&buf[fill], current->file_name, strlen(current->file_name));
+        write_le32(&buf[fill + PATCH_TOCENTRYLEN - 4], current->file_size);
+        if((fill += PATCH_TOCENTRYLEN) == sizeof(buf)) {
+            hash64_update(&state, buf, fill);
+            fill = 0;
+        }
+    }
+    hashed = hash64_update(&state, buf, fill);
+    return (hash64_final(&state, buf + hashed, fill - hashed));
+}
+
+/* Patch being written to standard output, a copy operation being kept
+   pending so that adjacent copies get merged */
+#define PATCH_HASH_UNKNOWN  0               /* old file hash states */
+#define PATCH_HASH_KNOWN    1
+#define PATCH_HASH_CHECKED  2               /* PATCH_CHECK written */
+struct patch_writer {
+    struct output out;
+    uint32_t copy_index;                    /* pending copy source */
+    uint32_t copy_offset;
+    uint32_t copy_length;                   /* 0 if none */
+    uint64_t *old_hashes;                   /* per old file */
+    uint8_t *old_hash_states;               /* per old file */
+};
+
+/* Append raw bytes to patch output (large ones written directly)
+   Returns 0 on success, -1 on error */
+static int
+write_patch(struct patch_writer *writer, const void *data, size_t size)
+{
+    struct output *out = &writer->out;
+
+    if(((size >= OUTPUT_BUFSIZE / 2) || (size > OUTPUT_BUFSIZE - out->len))
+        && (flush_output(out) < 0))
+        return (-1);
+    if(size >= OUTPUT_BUFSIZE / 2) {
+        if(grp_write_full(STDOUT_FILENO, data, size) < 0) {
+            out->error = 1;
+            return (-1);
+        }
+        return (0);
+    }
+    memcpy(out->buf + out->len, data, size);
+    out->len += size;
+    return (0);
+}
+
+/* Write pending copy operation, if any
+   Returns 0 on success, -1 on error */
+static int
+flush_patch_copy(struct patch_writer *writer)
+{
+    unsigned char op[PATCH_COPYLEN];
+
+    if(writer->copy_length == 0)
+        return (0);
+    op[0] = PATCH_COPY;
+    write_le32(&op[1], writer->copy_index);
+    write_le32(&op[5], writer->copy_offset);
+    write_le32(&op[9], writer->copy_length);
+    writer->copy_length = 0;
+    return (write_patch(writer, op, PATCH_COPYLEN));
+}
+
+/* Add a copy of length bytes of old file index (from offset) to patch,
+   preceded by a check of that file if it is its first copy (its hash
+   being known)
+   Returns 0 on success, -1 on error */
+static int
+patch_copy(struct patch_writer *writer, uint32_t index, uint32_t offset,
+    uint32_t length)
+{
+    if(length == 0)
+        return (0);
+    if((writer->copy_length > 0) && (writer->copy_index == index) &&
+        (writer->copy_offset + writer->copy_length == offset)) {
+        writer->copy_length += length;
+        return (0);
+    }
+    if(flush_patch_copy(writer) < 0)
+        return (-1);
+    if(writer->old_hash_states[index - 1] != PATCH_HASH_CHECKED) {
+        unsigned char op[PATCH_CHECKLEN];
+
+        op[0] = PATCH_CHECK;
+        write_le32(&op[1], index);
+        write_le64(&op[5], writer->old_hashes[index - 1]);
+        if(write_patch(writer, op, PATCH_CHECKLEN) < 0)
+            return (-1);
+        writer->old_hash_states[index - 1] = PATCH_HASH_CHECKED;
+    }
+    writer->copy_index = index;
+    writer->copy_offset = offset;
+    writer->copy_length = length;
+    return (0);
+}
+
+/* Add length bytes of literal data to patch, data being NULL when it is to
+   be written by caller
+   Returns 0 on success, -1 on error */
+static int
+patch_data(struct patch_writer *writer, const unsigned char *data,
+    uint32_t length)
+{
+    unsigned char op[PATCH_DATALEN];
+
+    if(length == 0)
+        return (0);
+    op[0] = PATCH_DATA;
+    write_le32(&op[1], length);
+    if((flush_patch_copy(writer) < 0) ||
+        (write_patch(writer, op, PATCH_DATALEN) < 0))
+        return (-1);
+    return ((data != NULL) ? write_patch(writer, data, length) : 0);
+}
+
+/* Read a file through buf (PATCH_BUFSIZE bytes), adding its data to hash
+   and, if writer is not NULL, to patch
+   Returns 0 on success, -1 on error */
+static int
+patch_file_data(struct patch_writer *writer, struct hash64_stream *hash,
+    struct grp_archive *archive, const struct grp_file *file,
+    unsigned char *buf)
+{
+    uint64_t done = 0;
+
+    while(done < file->file_size) {
+        ssize_t bytes = grp_pread(archive, file, buf, PATCH_BUFSIZE, done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "cannot read member data : %s\n",
+                file->file_name);
+            return (-1);
+        }
+        if(bytes == 0) {
+            fprintf(stderr, "file truncated : %s\n", file->file_name);
+            return (-1);
+        }
+        hash64_stream_update(hash, buf, bytes);
+        if((writer != NULL) && (write_patch(writer, buf, bytes) < 0))
+            return (-1);
+        done += bytes;
+    }
+    return (0);
+}
+
+/* Read a whole file into a new buffer (to be freed by caller)
+   Returns NULL on error */
+static unsigned char *
+load_file(struct grp_archive *archive, const struct grp_file *file)
+{
+    unsigned char *buf;
+    uint64_t done = 0;
+
+    if((buf = malloc(file->file_size + 1)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (NULL);
+    }
+    while(done < file->file_size) {
+        ssize_t bytes = grp_pread(archive, file, buf + done,
+            file->file_size - done, done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "cannot read member data : %s\n",
+                file->file_name);
+            free(buf);
+            return (NULL);
+        }
+        if(bytes == 0) {
+            fprintf(stderr, "file truncated : %s\n", file->file_name);
+            free(buf);
+            return (NULL);
+        }
+        done += bytes;
+    }
+    return (buf);
+}
+
+/* Rolling checksum of a block (rsync(1)'s), updated a byte at a time */
+#define ROLLING_A(sum)      ((sum) & 0xffff)
+#define ROLLING_B(sum)      ((sum) >> 16)
+static uint32_t
+rolling_sum(const unsigned char *buf, size_t size)
+{
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for(i = 0 ; i < size ; i++) {
+        a += buf[i];
+        b += (uint32_t)(size - i) * buf[i];
+    }
+    return ((a & 0xffff) | (b << 16));
+}
+
+static inline uint32_t
+rolling_update(uint32_t sum, unsigned char out, unsigned char in,
+    size_t size)
+{
+    uint32_t a = (ROLLING_A(sum) - out + in) & 0xffff;
+    uint32_t b = (ROLLING_B(sum) - (uint32_t)size * out + a) & 0xffff;
+
+    return (a | (b << 16));
+}
+
+/* Slot of a rolling checksum within a table of mask + 1 slots */
+#define ROLLING_SLOT(sum, mask) \
+    ((uint32_t)(((sum) * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (mask))
+
+/* Write new file data as a delta against old file data : blocks of old
+   file are indexed by rolling checksum, then new file is scanned for them,
+   matches being extended both ways
+   Returns 0 on success, -1 on error */
+static int
+patch_delta(struct patch_writer *writer, const struct grp_file *old_file,
+    const unsigned char *old_data, const unsigned char *new_data,
+    uint32_t new_size)
+{
+    uint32_t old_size = old_file->file_size;
+    uint32_t num_blocks = old_size / PATCH_BLOCKSIZE;
+    uint32_t *sums = NULL;
+    uint32_t *slots = NULL;                 /* block + 1, 0 if free */
+    uint32_t mask;
+    uint32_t size = 1;
+    uint32_t pos = 0;
+    uint32_t literal = 0;                   /* start of unmatched data */
+    uint32_t sum = 0;
+    uint32_t i;
+    int err = 0;
+
+    /* Keep load factor below 1/2 */
+    while((size < 2 * num_blocks) && (size < (UINT32_C(1) << 31)))
+        size <<= 1;
+    mask = size - 1;
+    if(((sums = malloc(sizeof(uint32_t) * (num_blocks + 1))) == NULL) ||
+        ((slots = calloc(size, sizeof(uint32_t))) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(sums);
+        return (-1);
+    }
 
-    /* Main header */
-    char headbuf[GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN];
+    /* Index old blocks, identical ones only once */
+    for(i = 0 ; i < num_blocks ; i++) {
+        const unsigned char *block = old_data + (size_t)i * PATCH_BLOCKSIZE;
+        uint32_t slot;
 
-    /* Per-file header */
-    char filebuf[GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN];
-    struct grp_file *current = NULL;
-    struct grp_file *previous = NULL;
+        sums[i] = rolling_sum(block, PATCH_BLOCKSIZE);
+        for(slot = ROLLING_SLOT(sums[i], mask) ; slots[slot] != 0 ;
+            slot = (slot + 1) & mask) {
+            uint32_t other = slots[slot] - 1;
 
-    if((filename == NULL) || (head == NULL) || (*head != NULL) ||
-        (num_files == NULL)) {
-        fprintf(stderr, "%s(): invalid argument\n", __func__);
-        return (-1);
+            if((sums[other] == sums[i]) && (memcmp(old_data +
+                (size_t)other * PATCH_BLOCKSIZE, block, PATCH_BLOCKSIZE) == 0))
+                break;
+        }
+        if(slots[slot] == 0)
+            slots[slot] = i + 1;
     }
 
-    /* Open group archive */
-    if((grp_file_handle = open(filename, O_RDONLY|O_BINARY)) < 0) {
-        fprintf(stderr, "cannot open group archive : %s\n", filename);
-        return (-1);
+    if((num_blocks > 0) && (new_size >= PATCH_BLOCKSIZE))
+        sum = rolling_sum(new_data, PATCH_BLOCKSIZE);
+    while((num_blocks > 0) && (new_size - pos >= PATCH_BLOCKSIZE)) {
+        uint32_t slot;
+        uint32_t src = 0, length = 0, back = 0;
+
+        for(slot = ROLLING_SLOT(sum, mask) ; slots[slot] != 0 ;
+            slot = (slot + 1) & mask) {
+            uint32_t block = slots[slot] - 1;
+
+            if((sums[block] == sum) && (memcmp(old_data +
+                (size_t)block * PATCH_BLOCKSIZE, new_data + pos,
+                PATCH_BLOCKSIZE) == 0)) {
+                src = block * PATCH_BLOCKSIZE;
+                length = PATCH_BLOCKSIZE;
+                break;
+            }
+        }
+
+        if(length == 0) {
+            /* No match : slide window by one byte */
+            if(new_size - pos > PATCH_BLOCKSIZE)
+                sum = rolling_update(sum, new_data[pos],
+                    new_data[pos + PATCH_BLOCKSIZE], PATCH_BLOCKSIZE);
+            pos++;
+            continue;
+        }
+
+        /* Extend match forward, then backward over unmatched data */
+        while((pos + length < new_size) && (src + length < old_size) &&
+            (old_data[src + length] == new_data[pos + length]))
+            length++;
+        while((pos - back > literal) && (src - back > 0) &&
+            (old_data[src - back - 1] == new_data[pos - back - 1]))
+            back++;
+        if((patch_data(writer, new_data + literal, pos - back - literal) <
+            0) || (patch_copy(writer, old_file->index, src - back,
+            length + back) < 0)) {
+            err = -1;
+            break;
+        }
+        pos += length;
+        literal = pos;
+        if(new_size - pos >= PATCH_BLOCKSIZE)
+            sum = rolling_sum(new_data + pos, PATCH_BLOCKSIZE);
     }
+    if((err == 0) &&
+        (patch_data(writer, new_data + literal, new_size - literal) < 0))
+        err = -1;
+
+    free(slots);
+    free(sums);
+    return (err);
+}
+
+/* Write a patch rebuilding new_archive from old_archive to standard
+   output : unchanged files (found as --diff does) are copied from old
+   archive, changed ones are written as deltas against the old file of the
+   same name, others as literal data
+   Verbose messages go to standard error
+   Returns 0 on success, -1 on error */
+int
+make_patch(struct grp_archive *old_archive, struct grp_archive *new_archive,
+    uint8_t verbose)
+{
+    const struct grp_file *current;
+    struct patch_writer writer;
+    struct hash64_stream new_hash;
+    unsigned char header[PATCH_HEADERLEN];
+    unsigned char trailer[PATCH_TRAILERLEN];
+    unsigned char *buf = NULL;
+    uint8_t *status;
+    uint32_t num_old_files = grp_num_files(old_archive);
+    uint32_t i;
+    int err = 0;
 
-    /* Read main header */
-    if(read(grp_file_handle, &headbuf[0], GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN)
-        < (GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN)) {
-        fprintf(stderr, "group archive header truncated\n");
-        close(grp_file_handle);
+    if(grp_is_streaming(old_archive) || grp_is_streaming(new_archive)) {
+        fprintf(stderr, "cannot make a patch from a group archive read "
+            "forward only\n");
         return (-1);
     }
 
-    /* Check file type */
-    if(strncmp(&headbuf[0], GRPHDR_MAGIC, GRPHDR_MAGICLEN) != 0) {
-        fprintf(stderr, "unrecognized group archive : %s\n", filename);
-        close(grp_file_handle);
-        return (-1);
+    writer.out.buf = NULL;
+    writer.copy_length = 0;
+    writer.old_hashes = NULL;
+    writer.old_hash_states = NULL;
+    if(((status = calloc(num_old_files + 1, sizeof(uint8_t))) == NULL) ||
+        ((writer.out.buf = malloc(OUTPUT_BUFSIZE)) == NULL) ||
+        ((writer.old_hashes = malloc(sizeof(uint64_t) *
+        (num_old_files + 1))) == NULL) ||
+        ((writer.old_hash_states = calloc(num_old_files + 1,
+        sizeof(uint8_t))) == NULL) ||
+        ((buf = malloc(PATCH_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        err = -1;
+        goto cleanup;
+    }
+    writer.out.len = 0;
+    writer.out.error = 0;
+
+    /* Unchanged files' hashes come from comparison */
+    if(compare_archives(old_archive, new_archive, status,
+        writer.old_hashes) < 0) {
+        err = -1;
+        goto cleanup;
+    }
+    for(i = 0 ; i < num_old_files ; i++) {
+        if(status[i] == DIFF_SAME)
+            writer.old_hash_states[i] = PATCH_HASH_KNOWN;
     }
 
-    /* Get number of files */
-    (*num_files) = le32toh(*((uint32_t *)&headbuf[GRPHDR_MAGICLEN]));
+    /* Header and new TOC, new archive hash starting with its own header
+       and TOC */
+    memcpy(header, PATCH_MAGIC, PATCH_MAGICLEN);
+    write_le32(&header[PATCH_MAGICLEN], PATCH_VERSION);
+    write_le32(&header[PATCH_MAGICLEN + 4], num_old_files);
+    write_le64(&header[PATCH_MAGICLEN + 8], hash_toc(old_archive));
+    write_le32(&header[PATCH_MAGICLEN + 16], grp_num_files(new_archive));
+    fflush(stdout);
+    write_patch(&writer, header, PATCH_HEADERLEN);
+    hash64_stream_init(&new_hash);
+    hash64_stream_update(&new_hash, (const unsigned char *)"KenSilverman",
+        12);
+    hash64_stream_update(&new_hash, &header[PATCH_MAGICLEN + 16], 4);
+    for(current = grp_next(new_archive, NULL) ; current != NULL ;
+        current = grp_next(new_archive, current)) {
+        unsigned char entry[PATCH_TOCENTRYLEN];
+
+        memset(entry, 0, PATCH_TOCENTRYLEN - 4);
+        memcpy(entry, current->file_name, strlen(current->file_name));
+        write_le32(&entry[PATCH_TOCENTRYLEN - 4], current->file_size);
+        write_patch(&writer, entry, PATCH_TOCENTRYLEN);
+        hash64_stream_update(&new_hash, entry, PATCH_TOCENTRYLEN);
+    }
 
-    uint32_t i = 0;
-    while(i < (*num_files)) {
-        /* Backup current structure pointer and initialize a new structure */
-        previous = current;
-        if((current = malloc(sizeof(struct grp_file))) == NULL) {
-            fprintf(stderr, "cannot allocate memory\n");
-            close(grp_file_handle);
-            return (-1);
+    /* Then data, file by file */
+    for(current = grp_next(new_archive, NULL) ;
+        (current != NULL) && (err == 0) && !writer.out.error ;
+        current = grp_next(new_archive, current)) {
+        const struct grp_file *old_file =
+            grp_lookup(old_archive, current->file_name);
+        const char *kind;
+
+        if((old_file != NULL) &&
+            (grp_lookup(new_archive, current->file_name) == current) &&
+            (status[old_file->index - 1] == DIFF_SAME)) {
+            kind = "unchanged";
+            if((patch_copy(&writer, old_file->index, 0,
+                current->file_size) < 0) ||
+                (patch_file_data(NULL, &new_hash, new_archive, current,
+                buf) < 0))
+                err = -1;
         }
-
-        /* Set head on first pass */
-        if(*head == NULL)
-            *head = current;
-
-        /* Read group archive's next 16 bytes */
-        if(read(grp_file_handle, &filebuf[0],
-            GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN)
-            < (GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN)) {
-            fprintf(stderr, "group archive header truncated\n");
-            close(grp_file_handle);
-            return (-1);
+        else if((old_file != NULL) &&
+            (old_file->file_size >= PATCH_BLOCKSIZE) &&
+            (current->file_size >= PATCH_BLOCKSIZE)) {
+            unsigned char *old_data, *new_data = NULL;
+
+            kind = "delta";
+            if(((old_data = load_file(old_archive, old_file)) == NULL) ||
+                ((new_data = load_file(new_archive, current)) == NULL))
+                err = -1;
+            else {
+                struct hash64 state;
+                size_t hashed;
+
+                if(writer.old_hash_states[old_file->index - 1] ==
+                    PATCH_HASH_UNKNOWN) {
+                    hash64_init(&state);
+                    hashed = hash64_update(&state, old_data,
+                        old_file->file_size);
+                    writer.old_hashes[old_file->index - 1] =
+                        hash64_final(&state, old_data + hashed,
+                        old_file->file_size - hashed);
+                    writer.old_hash_states[old_file->index - 1] =
+                        PATCH_HASH_KNOWN;
+                }
+                hash64_stream_update(&new_hash, new_data,
+                    current->file_size);
+                err = patch_delta(&writer, old_file, old_data, new_data,
+                    current->file_size);
+            }
+            free(new_data);
+            free(old_data);
         }
+        else {
+            /* Literal data */
+            kind = "data";
+            if((patch_data(&writer, NULL, current->file_size) < 0) ||
+                (patch_file_data(&writer, &new_hash, new_archive, current,
+                buf) < 0))
+                err = -1;
+        }
+        if((err == 0) && (verbose == 1))
+            fprintf(stderr, "%s (%s)\n", current->file_name, kind);
+    }
+    if(err == 0) {
+        flush_patch_copy(&writer);
+        write_le64(trailer, hash64_stream_final(&new_hash));
+        write_patch(&writer, trailer, PATCH_TRAILERLEN);
+    }
+    flush_output(&writer.out);
+    if(writer.out.error) {
+        fprintf(stderr, "cannot write to standard output\n");
+        err = -1;
+    }
+
+cleanup:
+    free(buf);
+    free(writer.old_hash_states);
+    free(writer.old_hashes);
+    free(writer.out.buf);
+    free(status);
+    return (err);
+}
 
-        /* Update current structure */
-        current->index = i + 1;
-        strncpy(&current->file_name[0], &filebuf[0], GRPHDR_FILENAMELEN);
-        current->file_name[GRPHDR_FILENAMELEN] = '\0';
-        current->file_size =
-            le32toh(*((uint32_t *)&filebuf[GRPHDR_FILENAMELEN]));
-        current->file_offset =
-            (previous == NULL) ?
-            /* first file */
-            (GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
-            ((GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * (*num_files))) :
-            /* next ones */
-            (previous->file_offset + previous->file_size);
-        current->next = NULL; /* will be set in next pass */
+/* Patch being read, through a buffer */
+struct patch_reader {
+    int handle;
+    unsigned char *buf;
+    size_t len;                             /* bytes buffered */
+    size_t pos;                             /* bytes consumed */
+};
 
-        /* Set previous' next pointer */
-        if(previous != NULL)
-            previous->next = current;
+/* Get up to size bytes of patch into *data (pointing into buffer)
+   Returns the number of bytes available (0 at end of patch) or -1 on
+   error */
+static ssize_t
+peek_patch(struct patch_reader *reader, const unsigned char **data,
+    size_t size)
+{
+    if(reader->pos == reader->len) {
+        ssize_t bytes;
 
-        i++;
+        while((bytes = read(reader->handle, reader->buf, PATCH_BUFSIZE)) <
+            0) {
+            if(errno != EINTR)
+                return (-1);
+        }
+        reader->len = bytes;
+        reader->pos = 0;
     }
-    return (grp_file_handle);
+    if(size > reader->len - reader->pos)
+        size = reader->len - reader->pos;
+    *data = reader->buf + reader->pos;
+    reader->pos += size;
+    return (size);
 }
 
-/* Un-initialize grp_file structures */
-void
-uninit_grp_files(int grp_file_handle, struct grp_file *head)
+/* Read exactly size bytes of patch into buf
+   Returns 0 on success, -1 on error (or if patch is truncated) */
+static int
+read_patch(struct patch_reader *reader, unsigned char *buf, size_t size)
 {
-    struct grp_file *current = head;
-    struct grp_file *next;
+    const unsigned char *data;
+    ssize_t bytes;
 
-    while(current != NULL) {
-        next = current->next;
-        free(current);
-        current = next;
+    while(size > 0) {
+        if((bytes = peek_patch(reader, &data, size)) <= 0)
+            return (-1);
+        memcpy(buf, data, bytes);
+        buf += bytes;
+        size -= bytes;
     }
-
-    close(grp_file_handle);
-    return;
+    return (0);
 }
 
-/* Dump grp_file structures */
-void
-dump_grp_files(struct grp_file *head, uint8_t verbose)
+/* Hash a whole file (from its start) through buf (PATCH_BUFSIZE bytes)
+   Returns 0 on success, -1 on error */
+static int
+hash_whole_file(int handle, unsigned char *buf, uint64_t *hash)
 {
-    struct grp_file *current = head;
+    struct hash64_stream stream;
+    ssize_t bytes;
 
-    while(current != NULL) {
-        if(verbose == 1)
-            fprintf(stdout, "%s (%d bytes, offset %d (0x%x))\n",
-                current->file_name, current->file_size,
-                (int)current->file_offset,
-                (int)current->file_offset);
-        else
-            fprintf(stdout, "%s\n", current->file_name);
-        current = current->next;
+    if(lseek(handle, 0, SEEK_SET) < 0)
+        return (-1);
+    hash64_stream_init(&stream);
+    while((bytes = read(handle, buf, PATCH_BUFSIZE)) != 0) {
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        hash64_stream_update(&stream, buf, bytes);
     }
-    return;
+    *hash = hash64_stream_final(&stream);
+    return (0);
 }
 
-/* Extract a single file from group archive */
+/* Rebuild a group archive (dst_filename) from old_archive and a patch made
+   by make_patch() (patch_filename, "-" meaning standard input), copying
+   old archive data in-kernel when possible
+   Old files are checked against their hash before their data is copied,
+   and the new archive against its hash once written
+   Returns 0 on success, -1 on error (new archive then being removed) */
 int
-extract_single_file(int grp_file_handle, const char *lookup_filename,
-    const char *dest_filename, struct grp_file *head, uint8_t verbose)
+apply_patch(struct grp_archive *old_archive, const char *patch_filename,
+    const char *dst_filename, uint8_t verbose)
 {
-    struct grp_file *current = head;
-    int dest_file_handle;
-#define RBUF_SIZE   512
-    char rbuf[RBUF_SIZE]; /* our read buffer */
-
-    if((lookup_filename == NULL) || (dest_filename == NULL)) {
-        fprintf(stderr, "%s(): invalid argument\n", __func__);
+    const struct grp_file **old_files = NULL;
+    const struct grp_file *current;
+    struct patch_reader reader;
+    unsigned char header[PATCH_HEADERLEN];
+    unsigned char trailer[PATCH_TRAILERLEN];
+    unsigned char *toc = NULL;
+    unsigned char *hash_buf = NULL;
+    uint8_t *old_checked = NULL;            /* per old file */
+    uint64_t hash;
+    uint32_t num_files;
+    uint32_t i;
+    int dst_handle = -1;
+    const unsigned char *data;
+
+    if(grp_is_streaming(old_archive)) {
+        fprintf(stderr, "cannot apply a patch to a group archive read "
+            "forward only\n");
         return (-1);
     }
 
-    while(current != NULL) {
-        /* If requested file found */
-        if(strncmp(lookup_filename, current->file_name, GRPHDR_FILENAMELEN)
-            == 0) {
-            if(verbose == 1)
-                fprintf(stdout, "%s\n", lookup_filename);
+    reader.buf = NULL;
+    reader.len = reader.pos = 0;
+    if(strcmp(patch_filename, "-") == 0)
+        reader.handle = 0;
+    else if((reader.handle = open(patch_filename, O_RDONLY|O_BINARY)) < 0) {
+        fprintf(stderr, "cannot open patch : %s\n", patch_filename);
+        return (-1);
+    }
+    if(((reader.buf = malloc(PATCH_BUFSIZE)) == NULL) ||
+        ((hash_buf = malloc(PATCH_BUFSIZE)) == NULL) ||
+        ((old_files = malloc(sizeof(struct grp_file *) *
+        (grp_num_files(old_archive) + 1))) == NULL) ||
+        ((old_checked = calloc(grp_num_files(old_archive) + 1,
+        sizeof(uint8_t))) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        goto error;
+    }
 
-            /* Open output file */
-            if((dest_file_handle =
-                open(dest_filename, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0660)) < 0) {
-                fprintf(stderr, "cannot create destination file : %s\n",
-                    dest_filename);
-                return (-1);
+    /* Check patch applies to old archive */
+    if((read_patch(&reader, header, PATCH_HEADERLEN) < 0) ||
+        (memcmp(header, PATCH_MAGIC, PATCH_MAGICLEN) != 0)) {
+        fprintf(stderr, "not a group archive patch : %s\n", patch_filename);
+        goto error;
+    }
+    if(read_le32(&header[PATCH_MAGICLEN]) != PATCH_VERSION) {
+        fprintf(stderr, "unsupported patch version : %u\n",
+            read_le32(&header[PATCH_MAGICLEN]));
+        goto error;
+    }
+    if((read_le32(&header[PATCH_MAGICLEN + 4]) !=
+        grp_num_files(old_archive)) ||
+        (read_le64(&header[PATCH_MAGICLEN + 8]) != hash_toc(old_archive))) {
+        fprintf(stderr, "patch does not apply to this group archive\n");
+        goto error;
+    }
+    num_files = read_le32(&header[PATCH_MAGICLEN + 16]);
+    for(current = grp_next(old_archive, NULL), i = 0 ; current != NULL ;
+        current = grp_next(old_archive, current))
+        old_files[i++] = current;
+
+    /* Write new archive header and TOC, as found in patch */
+    if((toc = malloc((size_t)num_files * PATCH_TOCENTRYLEN + 1)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        goto error;
+    }
+    if(read_patch(&reader, toc, (size_t)num_files * PATCH_TOCENTRYLEN) < 0) {
+        fprintf(stderr, "patch truncated : %s\n", patch_filename);
+        goto error;
+    }
+    if((dst_handle = open(dst_filename, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,
+        0660)) < 0) {
+        fprintf(stderr, "cannot create group archive : %s\n", dst_filename);
+        goto error;
+    }
+    memcpy(header, "KenSilverman", 12);
+    write_le32(&header[12], num_files);
+    if((grp_write_full(dst_handle, header, 16) < 0) ||
+        (grp_write_full(dst_handle, toc,
+        (size_t)num_files * PATCH_TOCENTRYLEN) < 0))
+        goto write_error;
+
+    /* Then rebuild files' data */
+    grp_advise(old_archive, NULL, GRP_ADVICE_SEQUENTIAL);
+    for(i = 0 ; i < num_files ; i++) {
+        uint32_t remaining = read_le32(&toc[i * PATCH_TOCENTRYLEN +
+            PATCH_TOCENTRYLEN - 4]);
+        char name[GRP_FILENAMELEN + 1];
+
+        memcpy(name, &toc[i * PATCH_TOCENTRYLEN], GRP_FILENAMELEN);
+        name[GRP_FILENAMELEN] = '\0';
+        while(remaining > 0) {
+            unsigned char op[PATCH_COPYLEN];
+            uint32_t length = 0;
+
+            if((read_patch(&reader, op, 1) < 0) ||
+                (read_patch(&reader, &op[1], (op[0] == PATCH_COPY) ?
+                PATCH_COPYLEN - 1 : (op[0] == PATCH_CHECK) ?
+                PATCH_CHECKLEN - 1 : PATCH_DATALEN - 1) < 0)) {
+                fprintf(stderr, "patch truncated : %s\n", patch_filename);
+                goto error;
             }
+            if(op[0] == PATCH_CHECK) {
+                uint32_t index = read_le32(&op[1]);
 
-            /* Seek to file position and copy data */
-            lseek(grp_file_handle, current->file_offset, SEEK_SET);
-
-            /* And copy file to destination */
-            uint32_t remaining_bytes = current->file_size;
-            int bytes_read;
-            while((bytes_read =
-                read(grp_file_handle, &rbuf[0], (remaining_bytes > RBUF_SIZE) ?
-                RBUF_SIZE : remaining_bytes)) > 0) {
-                if(write(dest_file_handle, &rbuf[0], bytes_read) < bytes_read) {
-                    fprintf(stderr, "incomplete write to destination file : "
-                        "%s\n", dest_filename);
-                    close(dest_file_handle);
-                    return (-1);
+                if((index < 1) || (index > grp_num_files(old_archive))) {
+                    fprintf(stderr, "invalid patch : %s\n", patch_filename);
+                    goto error;
+                }
+                if(old_checked[index - 1])
+                    continue;
+                if(hash_file(old_archive, old_files[index - 1], hash_buf,
+                    PATCH_BUFSIZE, &hash) <
+                    old_files[index - 1]->file_size) {
+                    fprintf(stderr, "cannot read member data : %s\n",
+                        old_files[index - 1]->file_name);
+                    goto error;
+                }
+                if(hash != read_le64(&op[5])) {
+                    fprintf(stderr, "patch does not apply to this group "
+                        "archive : %s differs\n",
+                        old_files[index - 1]->file_name);
+                    goto error;
                 }
-                remaining_bytes -= bytes_read;
+                old_checked[index - 1] = 1;
             }
-
-            /* Has whole file been copied ? */
-            if(remaining_bytes > 0) {
-                fprintf(stderr, "file partially extracted : %s\n",
-                    lookup_filename);
-                close(dest_file_handle);
-                return (-1);
+            else if(op[0] == PATCH_COPY) {
+                uint32_t index = read_le32(&op[1]);
+                uint32_t offset = read_le32(&op[5]);
+                int strategy;
+
+                length = read_le32(&op[9]);
+                if((index < 1) || (index > grp_num_files(old_archive)) ||
+                    !old_checked[index - 1] ||
+                    ((uint64_t)offset + length >
+                    old_files[index - 1]->file_size) ||
+                    (length > remaining) || (length == 0)) {
+                    fprintf(stderr, "invalid patch : %s\n", patch_filename);
+                    goto error;
+                }
+                if(grp_extract_range_fd(old_archive, old_files[index - 1],
+                    offset, length, dst_handle, &strategy) < length) {
+                    fprintf(stderr, "cannot copy member data : %s\n",
+                        old_files[index - 1]->file_name);
+                    goto error;
+                }
             }
+            else if(op[0] == PATCH_DATA) {
+                uint32_t copied = 0;
 
-            close(dest_file_handle);
-            return (0);
+                length = read_le32(&op[1]);
+                if((length > remaining) || (length == 0)) {
+                    fprintf(stderr, "invalid patch : %s\n", patch_filename);
+                    goto error;
+                }
+                while(copied < length) {
+                    ssize_t bytes = peek_patch(&reader, &data,
+                        length - copied);
+
+                    if(bytes <= 0) {
+                        fprintf(stderr, "patch truncated : %s\n",
+                            patch_filename);
+                        goto error;
+                    }
+                    if(grp_write_full(dst_handle, data, bytes) < 0)
+                        goto write_error;
+                    copied += bytes;
+                }
+            }
+            else {
+                fprintf(stderr, "invalid patch : %s\n", patch_filename);
+                goto error;
+            }
+            remaining -= length;
         }
-        current = current->next;
+        if(verbose == 1)
+            fprintf(stdout, "%s\n", name);
+    }
+    if(read_patch(&reader, trailer, PATCH_TRAILERLEN) < 0) {
+        fprintf(stderr, "patch truncated : %s\n", patch_filename);
+        goto error;
+    }
+    if(peek_patch(&reader, &data, 1) != 0) {
+        fprintf(stderr, "invalid patch : %s\n", patch_filename);
+        goto error;
+    }
+
+    /* Check rebuilt archive, as written */
+    if(hash_whole_file(dst_handle, hash_buf, &hash) < 0) {
+        fprintf(stderr, "cannot read group archive : %s\n", dst_filename);
+        goto error;
+    }
+    if(hash != read_le64(trailer)) {
+        fprintf(stderr, "rebuilt group archive does not match patch : %s\n",
+            dst_filename);
+        goto error;
     }
-    fprintf(stderr, "%s : not found in group archive\n", lookup_filename);
+
+    if(close(dst_handle) < 0) {
+        fprintf(stderr, "cannot write group archive : %s\n", dst_filename);
+        unlink(dst_filename);
+        dst_handle = -1;
+        goto error;
+    }
+    if(reader.handle != 0)
+        close(reader.handle);
+    free(toc);
+    free(old_checked);
+    free(old_files);
+    free(hash_buf);
+    free(reader.buf);
+    return (0);
+
+write_error:
+    fprintf(stderr, "cannot write group archive : %s\n", dst_filename);
+error:
+    if(dst_handle >= 0) {
+        close(dst_handle);
+        unlink(dst_filename);
+    }
+    if(reader.handle != 0)
+        close(reader.handle);
+    free(toc);
+    free(old_checked);
+    free(old_files);
+    free(hash_buf);
+    free(reader.buf);
     return (-1);
 }
 
-/* Extract all files from group archive */
-int
-extract_all_files(int grp_file_handle, const char *base_path,
-    struct grp_file *head, uint8_t verbose)
+/* Close layered archives, freeing their selected files */
+void
+close_layers(struct layer *layers, int num_layers)
 {
-    struct grp_file *current = head;
-    char *dest_path;
-    int err = 0;
-
-    if(base_path == NULL) {
-        fprintf(stderr, "%s(): invalid argument\n", __func__);
-        return (-1);
+    int i;
+
+    for(i = 0 ; i < num_layers ; i++) {
+        free(layers[i].files);
+        layers[i].files = NULL;
+        if(layers[i].archive != NULL)
+            grp_close(layers[i].archive);
+        layers[i].archive = NULL;
     }
+    free(layers);
+    return;
+}
 
-    while(current != NULL) {
-        dest_path = (char *)malloc(strlen(base_path) + 1 +
-            strlen(current->file_name) + 1); /* includes '/' and final '\0' */
-        if(dest_path == NULL) {
-            fprintf(stderr, "cannot allocate memory\n");
-            return (-1);
-        }
-        dest_path[0] = '\0';
-        strcat(dest_path, base_path);
-        strcat(dest_path, "/");
-        strcat(dest_path, current->file_name);
-
-        err |= extract_single_file(grp_file_handle,
-            current->file_name, dest_path, head, verbose);
+/* Open group archives given with -f, in order, loading their TOC
+   Returns layers (to be closed with close_layers()) or NULL on error */
+struct layer *
+open_layers(const struct program_options *options)
+{
+    struct layer *layers;
+    int i;
 
-        free(dest_path);
-        current = current->next;
+    if((layers = calloc(options->num_grp_filenames,
+        sizeof(struct layer))) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (NULL);
     }
-    return (err);
+    for(i = 0 ; i < options->num_grp_filenames ; i++) {
+        layers[i].grp_filename = options->grp_filenames[i];
+        if((layers[i].archive = grp_open(layers[i].grp_filename,
+            options->open_flags)) == NULL) {
+            fprintf(stderr, "error reading group archive TOC : %s\n",
+                layers[i].grp_filename);
+            close_layers(layers, i);
+            return (NULL);
+        }
+    }
+    return (layers);
 }
 
 /* Print grpar version */
@@ -355,15 +3428,56 @@ void
 usage(void)
 {
     version();
-    fprintf(stderr, "usage: grpar [-h] [-V] [-t|-x] [-C path] [-v] "
-        "-f grp_file [file_1] [file_2] [...]\n");
+    fprintf(stderr, "usage: grpar [-h] [-V] [-c|-r|-u|-t|-T|-x] [-C path] [-O] "
+        "[-j jobs] [-m] [-I] [-U] [-d] [-D store] [-S] "
+        "[-v] [--format=fmt] [--include=pattern] [--exclude=pattern] "
+        "[--regex] "
+        "-f grp_file [-f grp_file] [...] [file_1] [file_2] [...]\n");
+    fprintf(stderr, "       grpar --diff [-v] [--format=fmt] old_grp_file "
+        "new_grp_file\n");
+    fprintf(stderr, "       grpar --make-patch [-v] old_grp_file new_grp_file "
+        "> patch\n");
+    fprintf(stderr, "       grpar --apply-patch [-v] [-m] old_grp_file patch "
+        "-o new_grp_file\n");
     fprintf(stderr, "-h : this help\n");
     fprintf(stderr, "-V : version\n");
+    fprintf(stderr, "-c : create group archive from files\n");
+    fprintf(stderr, "-r : append files to group archive\n");
+    fprintf(stderr, "-u : add or replace files in group archive\n");
     fprintf(stderr, "-t : list files from group archive\n");
+    fprintf(stderr, "-T : verify group archive (print CRC32C of files)\n");
     fprintf(stderr, "-x : extract files from group archive\n");
     fprintf(stderr, "-C : specify destination directory\n");
+    fprintf(stderr, "-O : extract files to standard output\n");
+    fprintf(stderr, "-j : number of parallel extraction jobs\n");
+    fprintf(stderr, "-m : memory-map group archive\n");
+    fprintf(stderr, "-I : use (or write) TOC index file grp_file.grpidx\n");
+    fprintf(stderr, "-U : extract small files through io_uring (Linux)\n");
+    fprintf(stderr, "-d : link identical files (reflink, or hardlink)\n");
+    fprintf(stderr, "-D : also link files to/from store directory "
+        "(implies -d)\n");
+    fprintf(stderr, "-S : write runs of zeros as holes (sparse files)\n");
     fprintf(stderr, "-v : verbose mode\n");
-    fprintf(stderr, "-f : group archive\n");
+    fprintf(stderr, "--format : listing format (text, json, csv, tsv or "
+        "null0)\n");
+    fprintf(stderr, "--include : select files matching pattern (may be "
+        "repeated)\n");
+    fprintf(stderr, "--exclude : do not select files matching pattern (may "
+        "be repeated)\n");
+    fprintf(stderr, "--regex : patterns are extended regular expressions "
+        "instead of globs\n");
+    fprintf(stderr, "--to-tar : extract files to standard output, as a tar "
+        "(ustar) stream\n");
+    fprintf(stderr, "--diff : list files added (A), removed (D) or changed "
+        "(M) between two group\n         archives\n");
+    fprintf(stderr, "--make-patch : write a patch rebuilding second group "
+        "archive from first one\n");
+    fprintf(stderr, "--apply-patch : rebuild a group archive from another "
+        "one and a patch ('-' for\n                standard input)\n");
+    fprintf(stderr, "-o : group archive written by --apply-patch\n");
+    fprintf(stderr, "-f : group archive ('-' for standard input), may be "
+        "repeated to list\n     or extract files of several archives, "
+        "later ones overriding earlier ones\n");
     return;
 }
 
@@ -372,9 +3486,22 @@ void
 init_options(struct program_options *options)
 {
     /* Set default options */
-    options->grp_filename = NULL;
+    options->grp_filenames = NULL;
+    options->num_grp_filenames = 0;
     options->dst_dirname = NULL;
+    options->dst_filename = NULL;
+    options->store_dirname = NULL;
     options->action = ACTION_NONE;
+    options->open_flags = 0;
+    options->num_threads = 1;
+    options->uring = 0;
+    options->dedup = 0;
+    options->sparse = 0;
+    options->format = FORMAT_TEXT;
+    options->output = OUTPUT_FILES;
+    options->includes = options->excludes = NULL;
+    options->num_includes = options->num_excludes = 0;
+    options->regex = 0;
     options->verbose = 0;
 }
 
@@ -382,11 +3509,28 @@ init_options(struct program_options *options)
 void
 uninit_options(struct program_options *options)
 {
-    if(options->grp_filename != NULL)
-        free(options->grp_filename);
+    free(options->grp_filenames);
+    options->grp_filenames = NULL;
+    options->num_grp_filenames = 0;
     if(options->dst_dirname != NULL)
         free(options->dst_dirname);
+    if(options->dst_filename != NULL)
+        free(options->dst_filename);
+    if(options->store_dirname != NULL)
+        free(options->store_dirname);
+    free(options->includes);
+    free(options->excludes);
+    options->includes = options->excludes = NULL;
+    options->num_includes = options->num_excludes = 0;
+    options->regex = 0;
     options->action = ACTION_NONE;
+    options->open_flags = 0;
+    options->num_threads = 1;
+    options->uring = 0;
+    options->dedup = 0;
+    options->sparse = 0;
+    options->format = FORMAT_TEXT;
+    options->output = OUTPUT_FILES;
     options->verbose = 0;
 }
 
@@ -394,10 +3538,10 @@ int
 main(int argc, char **argv)
 {
     int ch;
+    int i;
 
-    struct grp_file *head = NULL;
-    uint32_t num_files = 0;
-    int grp_file_handle;
+    struct layer *layers;
+    int num_layers;
 
     /* Program options */
     struct program_options options;
@@ -412,7 +3556,8 @@ main(int argc, char **argv)
     }
 
     /* Options handling */
-    while ((ch = getopt(argc, argv, "?hVtxC:vf:")) != -1) {
+    while ((ch = getopt_long(argc, argv, "?hVcrutTxC:Oo:j:mIUdD:Svf:",
+        long_options, NULL)) != -1) {
         switch(ch) {
             case '?':
             case 'h':
@@ -425,23 +3570,31 @@ main(int argc, char **argv)
                 uninit_options(&options);
                 return (0);
                 break;
+            case 'c':
+            case 'r':
+            case 'u':
             case 't':
-                if(options.action != ACTION_NONE) {
-                    fprintf(stderr, "please specify either -t or -x option, "
-                        "not both\n");
-                    uninit_options(&options);
-                    return (1);
-                }
-                options.action = ACTION_LIST;
-                break;
+            case 'T':
             case 'x':
+            case OPT_DIFF:
+            case OPT_MAKE_PATCH:
+            case OPT_APPLY_PATCH:
                 if(options.action != ACTION_NONE) {
-                    fprintf(stderr, "please specify either -t or -x option, "
-                        "not both\n");
+                    fprintf(stderr, "please specify only one of -c, -r, -u, "
+                        "-t, -T, -x, --diff, --make-patch or --apply-patch "
+                        "options\n");
                     uninit_options(&options);
                     return (1);
                 }
-                options.action = ACTION_EXTRACT;
+                options.action = (ch == 'c') ? ACTION_CREATE :
+                    (ch == 'r') ? ACTION_APPEND :
+                    (ch == 'u') ? ACTION_UPDATE :
+                    (ch == 't') ? ACTION_LIST :
+                    (ch == 'T') ? ACTION_VERIFY :
+                    (ch == 'x') ? ACTION_EXTRACT :
+                    (ch == OPT_DIFF) ? ACTION_DIFF :
+                    (ch == OPT_MAKE_PATCH) ? ACTION_MAKE_PATCH :
+                    ACTION_APPLY_PATCH;
                 break;
             case 'C':
                 options.dst_dirname = malloc(strlen(optarg) + 1);
@@ -452,17 +3605,116 @@ main(int argc, char **argv)
                 }
                 strcpy(options.dst_dirname, optarg); 
                 break;
+            case 'O':
+                options.output = OUTPUT_RAW;
+                break;
+            case 'o':
+                options.dst_filename = malloc(strlen(optarg) + 1);
+                if(options.dst_filename == NULL) {
+                    fprintf(stderr, "cannot allocate memory\n");
+                    uninit_options(&options);
+                    return (1);
+                }
+                strcpy(options.dst_filename, optarg);
+                break;
+            case OPT_TO_TAR:
+                options.output = OUTPUT_TAR;
+                break;
+            case 'j':
+            {
+                char *endptr;
+                long num_threads = strtol(optarg, &endptr, 10);
+
+                if((*optarg == '\0') || (*endptr != '\0') ||
+                    (num_threads < 1) || (num_threads > MAX_THREADS)) {
+                    fprintf(stderr, "invalid number of jobs : %s "
+                        "(1 to %d allowed)\n", optarg, MAX_THREADS);
+                    uninit_options(&options);
+                    return (1);
+                }
+                options.num_threads = (unsigned int)num_threads;
+                break;
+            }
+            case 'm':
+                options.open_flags |= GRP_OPEN_MMAP;
+                break;
+            case 'I':
+                options.open_flags |= GRP_OPEN_INDEX;
+                break;
+            case 'U':
+                options.uring = 1;
+                break;
+            case 'D':
+                options.store_dirname = malloc(strlen(optarg) + 1);
+                if(options.store_dirname == NULL) {
+                    fprintf(stderr, "cannot allocate memory\n");
+                    uninit_options(&options);
+                    return (1);
+                }
+                strcpy(options.store_dirname, optarg);
+                /* FALLTHROUGH */
+            case 'd':
+                options.dedup = 1;
+                break;
+            case 'S':
+#if defined(HAVE_SPARSE)
+                options.sparse = 1;
+                break;
+#else
+                fprintf(stderr, "sparse files not supported\n");
+                uninit_options(&options);
+                return (1);
+#endif
             case 'v':
                 options.verbose = 1;
                 break;
+            case OPT_FORMAT:
+            {
+                uint8_t format = 0;
+
+                while((format < NUM_FORMATS) &&
+                    (strcmp(optarg, format_names[format]) != 0))
+                    format++;
+                if(format == NUM_FORMATS) {
+                    fprintf(stderr, "invalid listing format : %s "
+                        "(text, json, csv, tsv or null0 allowed)\n", optarg);
+                    uninit_options(&options);
+                    return (1);
+                }
+                options.format = format;
+                break;
+            }
+            case OPT_INCLUDE:
+            case OPT_EXCLUDE:
+            {
+                char ***patterns = (ch == OPT_INCLUDE) ?
+                    &options.includes : &options.excludes;
+                int *num_patterns = (ch == OPT_INCLUDE) ?
+                    &options.num_includes : &options.num_excludes;
+
+                /* Patterns point to arguments, there cannot be more */
+                if((*patterns == NULL) &&
+                    ((*patterns = malloc(sizeof(char *) * argc)) == NULL)) {
+                    fprintf(stderr, "cannot allocate memory\n");
+                    uninit_options(&options);
+                    return (1);
+                }
+                (*patterns)[(*num_patterns)++] = optarg;
+                break;
+            }
+            case OPT_REGEX:
+                options.regex = 1;
+                break;
             case 'f':
-                options.grp_filename = malloc(strlen(optarg) + 1);
-                if(options.grp_filename == NULL) {
+                /* Archives point to arguments, there cannot be more */
+                if((options.grp_filenames == NULL) &&
+                    ((options.grp_filenames = malloc(sizeof(char *) * argc)) ==
+                    NULL)) {
                     fprintf(stderr, "cannot allocate memory\n");
                     uninit_options(&options);
                     return (1);
                 }
-                strcpy(options.grp_filename, optarg); 
+                options.grp_filenames[options.num_grp_filenames++] = optarg;
                 break;
         }
     }
@@ -470,41 +3722,270 @@ main(int argc, char **argv)
     argv += optind;
 
     if(options.action == ACTION_NONE) {
-        fprintf(stderr, "please specify either -t or -x option\n");
+        fprintf(stderr, "please specify one of -c, -r, -u, -t, -T, -x, "
+            "--diff, --make-patch or --apply-patch options\n");
         uninit_options(&options);
         return (1);
     }
 
-    if(options.grp_filename == NULL) {
+    /* Archives to compare (or archive and patch) may also be given as
+       arguments */
+    if((options.action == ACTION_DIFF) ||
+        (options.action == ACTION_MAKE_PATCH) ||
+        (options.action == ACTION_APPLY_PATCH)) {
+        if((options.grp_filenames == NULL) &&
+            ((options.grp_filenames = malloc(sizeof(char *) * (argc + 1))) ==
+            NULL)) {
+            fprintf(stderr, "cannot allocate memory\n");
+            uninit_options(&options);
+            return (1);
+        }
+        for(i = 0 ; i < argc ; i++)
+            options.grp_filenames[options.num_grp_filenames++] = argv[i];
+        argc = 0;
+        if(options.num_grp_filenames != 2) {
+            fprintf(stderr, (options.action == ACTION_APPLY_PATCH) ?
+                "please specify a group archive and a patch\n" :
+                (options.action == ACTION_MAKE_PATCH) ?
+                "please specify two group archives\n" :
+                "please specify two group archives to compare\n");
+            uninit_options(&options);
+            return (1);
+        }
+    }
+
+    if(options.num_grp_filenames <= 0) {
         fprintf(stderr, "please specify a group archive\n");
         uninit_options(&options);
         return (1);
     }
+    for(i = 1 ; i < options.num_grp_filenames ; i++) {
+        int j;
+
+        for(j = 0 ; (j < i) && (strcmp(options.grp_filenames[i], "-") == 0) ;
+            j++) {
+            if(strcmp(options.grp_filenames[j], "-") == 0) {
+                fprintf(stderr, "standard input can be read only once\n");
+                uninit_options(&options);
+                return (1);
+            }
+        }
+    }
+
+    /* Create or update group archive, TOC is handled separately */
+    if((options.action == ACTION_CREATE) || (options.action == ACTION_APPEND) ||
+        (options.action == ACTION_UPDATE)) {
+        int flags = (options.verbose == 1) ? GRP_VERBOSE : 0;
+        const char *grp_filename = options.grp_filenames[0];
+
+        if(options.num_grp_filenames > 1) {
+            fprintf(stderr, "please specify a single group archive to "
+                "write\n");
+            uninit_options(&options);
+            return (1);
+        }
+        if(strcmp(grp_filename, "-") == 0) {
+            fprintf(stderr, "cannot write group archive to standard "
+                "output\n");
+            uninit_options(&options);
+            return (1);
+        }
+        if(argc <= 0) {
+            fprintf(stderr, "please specify files to archive\n");
+            uninit_options(&options);
+            return (1);
+        }
+        if(((options.action == ACTION_CREATE) ?
+            grp_create(grp_filename, argv, argc, flags) :
+            grp_update(grp_filename, argv, argc,
+            flags | ((options.action == ACTION_UPDATE) ?
+            GRP_UPDATE_REPLACE : 0))) < 0) {
+            uninit_options(&options);
+            return (1);
+        }
+        if(options.verbose == 1)
+            fprintf(stdout, "%d files archived\n", argc);
+        uninit_options(&options);
+        return (0);
+    }
+
+    /* Rebuild group archive from patch */
+    if(options.action == ACTION_APPLY_PATCH) {
+        struct grp_archive *archive;
+        struct stat grp_file_stat, dst_file_stat;
+        int err;
+
+        if(options.dst_filename == NULL) {
+            fprintf(stderr, "please specify a group archive to write (-o)\n");
+            uninit_options(&options);
+            return (1);
+        }
+        if((stat(options.grp_filenames[0], &grp_file_stat) == 0) &&
+            (stat(options.dst_filename, &dst_file_stat) == 0) &&
+            (grp_file_stat.st_dev == dst_file_stat.st_dev) &&
+            (grp_file_stat.st_ino == dst_file_stat.st_ino)) {
+            fprintf(stderr, "cannot write patched group archive over "
+                "original one : %s\n", options.dst_filename);
+            uninit_options(&options);
+            return (1);
+        }
+        if((archive = grp_open(options.grp_filenames[0],
+            options.open_flags)) == NULL) {
+            fprintf(stderr, "error reading group archive TOC : %s\n",
+                options.grp_filenames[0]);
+            uninit_options(&options);
+            return (1);
+        }
+        err = apply_patch(archive, options.grp_filenames[1],
+            options.dst_filename, options.verbose);
+        grp_close(archive);
+        uninit_options(&options);
+        return ((err < 0) ? 1 : 0);
+    }
 
-    /* Load grp file TOC into memory */
-    if((grp_file_handle = init_grp_files(options.grp_filename, &head,
-        &num_files)) < 0) {
-        fprintf(stderr, "error reading group archive TOC\n");
-        uninit_grp_files(grp_file_handle, head);
+    /* Load grp files TOC into memory */
+    num_layers = options.num_grp_filenames;
+    if((layers = open_layers(&options)) == NULL) {
         uninit_options(&options);
         return (1);
     }
+    /* Files (or patch) written to standard output : one at a time, no
+       message there */
+    if(options.action == ACTION_MAKE_PATCH)
+        options.output = OUTPUT_RAW;
+    if(options.output != OUTPUT_FILES) {
+        options.num_threads = 1;
+        options.uring = options.dedup = 0;
+    }
+    for(i = 0 ; i < num_layers ; i++) {
+        struct grp_archive *archive = layers[i].archive;
+
+        if((options.open_flags & GRP_OPEN_MMAP) && !grp_is_mapped(archive) &&
+            (options.verbose == 1) && (options.output == OUTPUT_FILES))
+            fprintf(stdout, "cannot map group archive, falling back to "
+                "regular reads : %s\n", layers[i].grp_filename);
+        if((options.uring == 1) &&
+            (grp_is_streaming(archive) || !grp_uring_supported())) {
+            if(options.verbose == 1)
+                fprintf(stdout, "io_uring unavailable, falling back to "
+                    "regular extraction\n");
+            options.uring = 0;
+        }
+#if defined(HAVE_OPENAT)
+        if((options.dedup == 1) && grp_is_streaming(archive)) {
+#else
+        if(options.dedup == 1) {
+#endif
+            if(options.verbose == 1)
+                fprintf(stdout, "cannot link identical files, falling back "
+                    "to regular extraction\n");
+            options.dedup = 0;
+        }
+    }
 
     /* Let's go */
     if(options.action == ACTION_LIST) {
-        dump_grp_files(head, options.verbose);
+        int64_t num_files;
+
+        if(((num_files = select_layer_files(layers, num_layers, argv, argc,
+            &options, 1)) < 0) ||
+            (dump_grp_files(layers, num_layers, options.format,
+            options.verbose) < 0)) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+        if((options.verbose == 1) && (options.format == FORMAT_TEXT))
+            fprintf(stdout, "%d files found\n", (int)num_files);
+    }
+    else if(options.action == ACTION_VERIFY) {
+        int64_t num_files = 0;
+        int err = 0;
+
+        /* Archives are verified as a whole, shadowed files included */
+        for(i = 0 ; i < num_layers ; i++) {
+            if(num_layers > 1)
+                fprintf(stdout, "%s%s :\n", (i > 0) ? "\n" : "",
+                    layers[i].grp_filename);
+            if(verify_all_files(layers[i].archive, options.verbose) < 0) {
+                fprintf(stderr, "group archive is damaged : %s\n",
+                    layers[i].grp_filename);
+                err = -1;
+            }
+            num_files += grp_num_files(layers[i].archive);
+        }
+        if(err < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
         if(options.verbose == 1)
-            fprintf(stdout, "%d files found\n", num_files);
+            fprintf(stdout, "%d files verified\n", (int)num_files);
+    }
+    else if(options.action == ACTION_MAKE_PATCH) {
+        if(isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "refusing to write patch to a terminal\n");
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+        if(make_patch(layers[0].archive, layers[1].archive,
+            options.verbose) < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+    }
+    else if(options.action == ACTION_DIFF) {
+        int64_t num_differences;
+
+        if((num_differences = diff_archives(layers[0].archive,
+            layers[1].archive, options.format)) < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+        if((options.verbose == 1) && (options.format == FORMAT_TEXT))
+            fprintf(stdout, "%d differences found\n", (int)num_differences);
+    }
+    else if((options.action == ACTION_EXTRACT) &&
+        (options.output != OUTPUT_FILES)) {
+        int err = 0;
+
+        /* Write files to standard output, raw or as a tar stream */
+        if(select_layer_files(layers, num_layers, argv, argc, &options,
+            0) < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+        for(i = 0 ; (i < num_layers) && (err >= 0) ; i++) {
+            if(output_all_files(layers[i].archive, layers[i].files,
+                layers[i].num_files, options.output, options.verbose) < 0)
+                err = -1;
+        }
+        if((err == 0) && (options.output == OUTPUT_TAR) &&
+            (end_tar_output() < 0))
+            err = -1;
+        if(err < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
     }
     else if(options.action == ACTION_EXTRACT) {
         struct stat dst_dirname_stat;
+        struct dest_dir dest_dir;
+        struct dedup dedup;
+        int64_t num_files;
+        int err = 0;
 
         /* Set default destination directory */
         if(options.dst_dirname == NULL) {
             options.dst_dirname = malloc(strlen(".") + 1);
             if(options.dst_dirname == NULL) {
                 fprintf(stderr, "cannot allocate memory\n");
-                uninit_grp_files(grp_file_handle, head);
+                close_layers(layers, num_layers);
                 uninit_options(&options);
                 return (1);
             }
@@ -522,54 +4003,63 @@ main(int argc, char **argv)
             (!S_ISDIR(dst_dirname_stat.st_mode))) {
             fprintf(stderr, "invalid destination directory specified : %s\n",
                 options.dst_dirname);
-            uninit_grp_files(grp_file_handle, head);
+            close_layers(layers, num_layers);
             uninit_options(&options);
             return (1);
         }
 
-        if(argc <= 0) {
-            /* No file specified, extract everything */
-            if(extract_all_files(grp_file_handle, options.dst_dirname, head,
-                options.verbose) < 0) {
-                fprintf(stderr, "files extracted, with error(s)\n");
-            }
-            else {
-                if(options.verbose == 1)
-                    fprintf(stdout, "%d files extracted\n", num_files);
-            }
+        if(open_dest_dir(options.dst_dirname, &dest_dir) < 0) {
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
         }
-        else {
-            int i;
-            char *dest_path = NULL;
-            /* Extract specified file(s) */
-            for(i = 0 ; i < argc ; i++) {
-                dest_path = (char *)malloc(strlen(options.dst_dirname) + 1 +
-                    strlen(argv[i]) + 1); /* includes '/' and final '\0' */
-                if(dest_path == NULL) {
-                    fprintf(stderr, "cannot allocate memory\n");
-                    uninit_grp_files(grp_file_handle, head);
-                    uninit_options(&options);
-                    return (1);
-                }
-                dest_path[0] = '\0';
-                strcat(dest_path, options.dst_dirname);
-                strcat(dest_path, "/");
-                strcat(dest_path, argv[i]);
-                extract_single_file(grp_file_handle, argv[i], dest_path, head,
-                    options.verbose);
-                free(dest_path);
-            }
+        dest_dir.sparse = options.sparse;
+
+        /* Select files, unless everything is to be extracted */
+        if((num_files = select_layer_files(layers, num_layers, argv, argc,
+            &options, 1)) < 0) {
+            close_dest_dir(&dest_dir);
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+
+#if defined(HAVE_OPENAT)
+        if((options.dedup == 1) && (init_dedup(num_files,
+            options.store_dirname, &dedup) < 0)) {
+            close_dest_dir(&dest_dir);
+            close_layers(layers, num_layers);
+            uninit_options(&options);
+            return (1);
+        }
+#endif
+        /* Each archive is read once, in offset order */
+        for(i = 0 ; i < num_layers ; i++) {
+            if((layers[i].num_files > 0) && (extract_all_files(
+                layers[i].archive, &dest_dir, layers[i].files,
+                layers[i].num_files, (options.dedup == 1) ? &dedup : NULL,
+                options.num_threads, options.uring, options.verbose) < 0))
+                err = -1;
         }
+        if(err < 0)
+            fprintf(stderr, "files extracted, with error(s)\n");
+        else if(options.verbose == 1)
+            fprintf(stdout, "%d files extracted\n", (int)num_files);
+#if defined(HAVE_OPENAT)
+        if(options.dedup == 1)
+            uninit_dedup(&dedup);
+#endif
+        close_dest_dir(&dest_dir);
     }
     else {
         /* NOTREACHED */
         fprintf(stderr, "congratulations, you have reached an unreachable part "
             "of the code\n");
-        uninit_grp_files(grp_file_handle, head);
+        close_layers(layers, num_layers);
         uninit_options(&options);
         return (1);
     }
-    uninit_grp_files(grp_file_handle, head);
+    close_layers(layers, num_layers);
     uninit_options(&options);
     return (0);
 }
@@ -0,0 +1,368 @@
+/*-
+ * Copyright (c) 2010-2014 Ganael LAPLANCHE <ganael.laplanche@martymac.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+   grpfs : read-only FUSE file system exposing the files of a group archive
+
+   Usage : grpfs [fuse options] grp_file mount_point
+
+   Files are looked up through libgrp's name index (case-insensitively, as
+   the Build engine does) and read with pread(2) on the archive. Whole small
+   files are kept in a cache, as they are typically read several times
+   (in small chunks) by tools.
+*/
+
+#define FUSE_USE_VERSION 31
+
+/* uint32_t, uint64_t, uintptr_t */
+#include <stdint.h>
+
+/* fprintf(3) */
+#include <stdio.h>
+
+/* malloc(3) */
+#include <stdlib.h>
+
+/* strcmp(3) */
+#include <string.h>
+
+/* errno(2) */
+#include <errno.h>
+
+/* O_ACCMODE */
+#include <fcntl.h>
+
+/* stat(2) */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* pthread_mutex_lock(3) */
+#include <pthread.h>
+
+/* fuse_main(3) */
+#include <fuse.h>
+
+#include "libgrp.h"
+
+/* Read cache : whole files of at most CACHE_MAXSIZE bytes, in a direct
+   mapped table indexed by file index */
+#define CACHE_SLOTS         256             /* number of slots */
+#define CACHE_MAXSIZE       (64 * 1024)     /* biggest file cached */
+struct cache_slot {
+    pthread_mutex_t lock;                   /* protects slot */
+    uint32_t index;                         /* file cached (0 if none) */
+    uint32_t size;                          /* bytes cached */
+    char *data;                             /* CACHE_MAXSIZE bytes */
+};
+
+/* File system state */
+struct grpfs {
+    const char *grp_filename;               /* archive path */
+    struct grp_archive *archive;
+    struct stat archive_stat;               /* for files' times and owner */
+    struct cache_slot cache[CACHE_SLOTS];
+};
+
+static struct grpfs grpfs;
+
+/* Initialize read cache
+   Returns 0 on success, -1 on error */
+static int
+init_cache(struct cache_slot *cache)
+{
+    int i;
+
+    for(i = 0 ; i < CACHE_SLOTS ; i++) {
+        pthread_mutex_init(&cache[i].lock, NULL);
+        cache[i].index = 0;
+        cache[i].size = 0;
+        cache[i].data = NULL;
+    }
+    for(i = 0 ; i < CACHE_SLOTS ; i++) {
+        if((cache[i].data = malloc(CACHE_MAXSIZE)) == NULL) {
+            fprintf(stderr, "cannot allocate memory\n");
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/* Un-initialize read cache */
+static void
+uninit_cache(struct cache_slot *cache)
+{
+    int i;
+
+    for(i = 0 ; i < CACHE_SLOTS ; i++) {
+        free(cache[i].data);
+        cache[i].data = NULL;
+        cache[i].index = 0;
+        pthread_mutex_destroy(&cache[i].lock);
+    }
+    return;
+}
+
+/* Read a whole file into buf (file_size bytes at most)
+   Returns the number of bytes read (less than file size if archive is
+   truncated) or -1 on error */
+static ssize_t
+read_file(const struct grp_file *file, char *buf, size_t size,
+    uint64_t offset)
+{
+    size_t done = 0;
+
+    while(done < size) {
+        ssize_t bytes = grp_pread(grpfs.archive, file, buf + done,
+            size - done, offset + done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        if(bytes == 0)
+            break;
+        done += bytes;
+    }
+    return (done);
+}
+
+/* Find the file a path refers to
+   Returns NULL if not found */
+static const struct grp_file *
+lookup_path(const char *path)
+{
+    /* Flat directory : "/name" */
+    if((path[0] != '/') || (strchr(&path[1], '/') != NULL))
+        return (NULL);
+    return (grp_lookup(grpfs.archive, &path[1]));
+}
+
+static void *
+grpfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void)conn;
+
+    /* Archive does not change while mounted */
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = 3600.0;
+    cfg->attr_timeout = 3600.0;
+    cfg->negative_timeout = 3600.0;
+    return (NULL);
+}
+
+static int
+grpfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    const struct grp_file *file;
+
+    (void)fi;
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = grpfs.archive_stat.st_uid;
+    st->st_gid = grpfs.archive_stat.st_gid;
+    st->st_atime = grpfs.archive_stat.st_atime;
+    st->st_mtime = grpfs.archive_stat.st_mtime;
+    st->st_ctime = grpfs.archive_stat.st_ctime;
+
+    if(strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+        return (0);
+    }
+    if((file = lookup_path(path)) == NULL)
+        return (-ENOENT);
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = file->file_size;
+    st->st_blocks = (file->file_size + 511) / 512;
+    return (0);
+}
+
+static int
+grpfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    const struct grp_file *current;
+
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    if(strcmp(path, "/") != 0)
+        return (-ENOENT);
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for(current = grp_next(grpfs.archive, NULL) ; current != NULL ;
+        current = grp_next(grpfs.archive, current)) {
+        /* Skip names that cannot be looked up : empty, holding a '/' or
+           shadowed by a previous file of the same name */
+        if((current->file_name[0] == '\0') ||
+            (strchr(current->file_name, '/') != NULL) ||
+            (grp_lookup(grpfs.archive, current->file_name) != current))
+            continue;
+        if(filler(buf, current->file_name, NULL, 0, 0) != 0)
+            break;
+    }
+    return (0);
+}
+
+static int
+grpfs_open(const char *path, struct fuse_file_info *fi)
+{
+    const struct grp_file *file;
+
+    if((file = lookup_path(path)) == NULL)
+        return (-ENOENT);
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return (-EROFS);
+
+    /* Keep entry at hand for reads */
+    fi->fh = (uint64_t)(uintptr_t)file;
+    fi->keep_cache = 1;
+    return (0);
+}
+
+static int
+grpfs_read(const char *path, char *buf, size_t size, off_t offset,
+    struct fuse_file_info *fi)
+{
+    const struct grp_file *file = (const struct grp_file *)(uintptr_t)fi->fh;
+    struct cache_slot *slot;
+    ssize_t bytes;
+
+    (void)path;
+    if((offset < 0) || ((uint64_t)offset >= file->file_size))
+        return (0);
+    if(size > file->file_size - (uint64_t)offset)
+        size = file->file_size - offset;
+
+    /* Big file : straight from archive */
+    if(file->file_size > CACHE_MAXSIZE) {
+        if((bytes = read_file(file, buf, size, offset)) < 0)
+            return (-errno);
+        return (bytes);
+    }
+
+    /* Small file : through cache */
+    slot = &grpfs.cache[file->index % CACHE_SLOTS];
+    pthread_mutex_lock(&slot->lock);
+    if(slot->index != file->index) {
+        if((bytes = read_file(file, slot->data, file->file_size, 0)) < 0) {
+            int error = errno;
+
+            slot->index = 0;
+            pthread_mutex_unlock(&slot->lock);
+            return (-error);
+        }
+        slot->index = file->index;
+        slot->size = bytes;
+    }
+    if((uint64_t)offset >= slot->size)
+        size = 0;
+    else if(size > slot->size - (uint64_t)offset)
+        size = slot->size - offset;
+    memcpy(buf, slot->data + offset, size);
+    pthread_mutex_unlock(&slot->lock);
+    return (size);
+}
+
+static const struct fuse_operations grpfs_operations = {
+    .init = grpfs_init,
+    .getattr = grpfs_getattr,
+    .readdir = grpfs_readdir,
+    .open = grpfs_open,
+    .read = grpfs_read,
+};
+
+/* Pick group archive from command line (first non-option argument), leaving
+   other arguments to FUSE */
+static int
+parse_option(void *data, const char *arg, int key,
+    struct fuse_args *outargs)
+{
+    (void)data;
+    (void)outargs;
+    if((key == FUSE_OPT_KEY_NONOPT) && (grpfs.grp_filename == NULL)) {
+        grpfs.grp_filename = arg;
+        return (0);
+    }
+    return (1);
+}
+
+/* Print grpfs usage */
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: grpfs [fuse options] grp_file mount_point\n");
+    return;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int ret;
+
+    grpfs.grp_filename = NULL;
+    if(fuse_opt_parse(&args, NULL, NULL, &parse_option) < 0)
+        return (1);
+    if(grpfs.grp_filename == NULL) {
+        usage();
+        fuse_opt_free_args(&args);
+        return (1);
+    }
+
+    /* Load grp file TOC and name index once, before serving requests */
+    if((grpfs.archive = grp_open(grpfs.grp_filename, 0)) == NULL) {
+        fprintf(stderr, "error reading group archive TOC\n");
+        fuse_opt_free_args(&args);
+        return (1);
+    }
+    if(grp_is_streaming(grpfs.archive) ||
+        (stat(grpfs.grp_filename, &grpfs.archive_stat) < 0)) {
+        fprintf(stderr, "cannot serve a group archive read forward only : "
+            "%s\n", grpfs.grp_filename);
+        grp_close(grpfs.archive);
+        fuse_opt_free_args(&args);
+        return (1);
+    }
+    if(init_cache(grpfs.cache) < 0) {
+        uninit_cache(grpfs.cache);
+        grp_close(grpfs.archive);
+        fuse_opt_free_args(&args);
+        return (1);
+    }
+
+    /* Members will be picked here and there */
+    grp_advise(grpfs.archive, NULL, GRP_ADVICE_RANDOM);
+
+    ret = fuse_main(args.argc, args.argv, &grpfs_operations, NULL);
+
+    uninit_cache(grpfs.cache);
+    grp_close(grpfs.archive);
+    fuse_opt_free_args(&args);
+    return (ret);
+}
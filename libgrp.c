@@ -0,0 +1,2663 @@
+/*-
+ * Copyright (c) 2010-2014 Ganael LAPLANCHE <ganael.laplanche@martymac.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+   Group file format, see : http://advsys.net/ken/build.htm
+   12 bytes : "KenSilverman"
+    4 bytes : number of files (little-endian)
+
+   Then, for each file :
+   12 bytes : file name (zero-filled)
+    4 bytes : file size (little-endian)
+
+   Then, for each file :
+    n bytes : file data
+    [...]
+*/
+
+#if defined(__linux__)
+  /* copy_file_range(2) */
+  #define _GNU_SOURCE
+#endif
+
+/* uint32_t, uint8_t */
+#include <stdint.h>
+
+/* printf(3) */
+#include <stdio.h>
+
+/* malloc(3) */
+#include <stdlib.h>
+
+/* strncmp(3) */
+#include <string.h>
+
+/* toupper(3) */
+#include <ctype.h>
+
+/* errno(2) */
+#include <errno.h>
+
+/* open(2) */
+#include <fcntl.h>
+
+/* read(2) */
+#include <sys/types.h>
+#if defined(_WIN32)
+  #include <io.h>
+#else
+  #include <sys/uio.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__FreeBSD__)
+  /* le32toh(9) */
+  #include <sys/endian.h>
+#elif defined(__linux__)
+  /* le32toh(3) */
+  #include <endian.h>
+#else
+  #define le32toh(x) (x)
+  #define htole32(x) (x)
+#endif
+
+/* stat(2) */
+#include <sys/stat.h>
+
+#include "libgrp.h"
+
+/* copy_file_range(2), sendfile(2), splice(2) */
+#if defined(__linux__)
+  #include <sys/sendfile.h>
+  #define HAVE_COPY_FILE_RANGE
+  #define HAVE_SENDFILE
+  #define HAVE_SPLICE
+#elif defined(__FreeBSD__)
+  #include <sys/param.h>
+  #if __FreeBSD_version >= 1300037
+    #define HAVE_COPY_FILE_RANGE
+  #endif
+#endif
+
+/* io_uring(7) (Linux 5.6 and later, checked at runtime) */
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
+    #if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+      #define HAVE_IO_URING
+    #endif
+  #endif
+#endif
+
+/* CRC32C instruction (SSE4.2), used if supported by running CPU */
+#if defined(__x86_64__) && defined(__GNUC__)
+  #include <nmmintrin.h>
+  #define HAVE_SSE42_CRC32C
+#endif
+
+/* Compressed archives, decoded by a separate thread (optional) */
+#if defined(WITH_ZLIB)
+  #include <zlib.h>
+#endif
+#if defined(WITH_ZSTD)
+  #include <zstd.h>
+#endif
+#if (defined(WITH_ZLIB) || defined(WITH_ZSTD)) && !defined(_WIN32)
+  #include <pthread.h>
+  #include <signal.h>
+  #define HAVE_DECOMPRESS
+#endif
+
+/* mmap(2), madvise(2) */
+#if !defined(_WIN32)
+  #include <sys/mman.h>
+  #define HAVE_MMAP
+#endif
+
+/* posix_fadvise(2) */
+#if defined(__linux__) || defined(__FreeBSD__)
+  #define HAVE_POSIX_FADVISE
+#endif
+
+/* Windows-Unix compat */
+#if !defined(O_BINARY)
+  #define O_BINARY 0
+#endif
+#if !defined(S_ISDIR)
+  #define S_ISDIR(mode)  (((mode) & S_IFMT) == S_IFDIR)
+#endif
+#if !defined(STDIN_FILENO)
+  #define STDIN_FILENO 0
+#endif
+#if defined(_WIN32)
+  /* Not atomic, but only used by a single thread there */
+  #define pread(fd, buf, count, offset) \
+    ((lseek((fd), (offset), SEEK_SET) < 0) ? -1 : read((fd), (buf), (count)))
+#endif
+
+#define GRPHDR_MAGIC        "KenSilverman"  /* magic */
+#define GRPHDR_MAGICLEN     12              /* magic length */
+#define GRPHDR_NUMFILESLEN  4               /* bytes for number of files */
+
+#define GRPHDR_FILENAMELEN  GRP_FILENAMELEN /* bytes for file name */
+#define GRPHDR_FILESIZELEN  4               /* bytes for file size */
+
+/* Hashed name index over grp_file entries
+   Buckets and chain links hold entry index + 1 (i.e. grp_file's index
+   member), 0 marking the end of a chain */
+struct grp_index {
+    uint32_t num_files;                     /* number of entries indexed */
+    uint32_t num_buckets;                   /* power of 2 */
+    uint32_t *buckets;                      /* first entry of each bucket */
+    uint32_t *chain;                        /* next entry, for each entry */
+};
+
+/* Compression formats, recognized by their magic number */
+#define COMPRESS_NONE       0
+#define COMPRESS_GZIP       1               /* 1f 8b */
+#define COMPRESS_ZSTD       2               /* 28 b5 2f fd */
+#define COMPRESS_MAGICLEN   4               /* bytes needed to detect them */
+static const char *compress_format_names[] = { "none", "gzip", "zstd" };
+
+/* Decoder of a compressed archive */
+struct grp_decoder;
+
+/* Group archive */
+struct grp_archive {
+    int handle;                             /* file handle on group archive */
+    unsigned char *map;                     /* mapped archive or NULL */
+    size_t map_size;                        /* mapped length */
+    struct grp_file *files;                 /* entries, in archive order */
+    uint32_t num_files;                     /* number of entries */
+    struct grp_index index;                 /* name index over entries */
+    uint8_t streaming;                      /* read forward only (stdin) */
+    uint64_t stream_offset;                 /* current offset when streaming */
+    char *stream_buf;                       /* buffer used when streaming */
+    unsigned char *idx_map;                 /* mapped index file or NULL */
+    size_t idx_map_size;                    /* mapped index file length */
+    struct grp_decoder *decoder;            /* decoder or NULL */
+};
+
+/* Sidecar index file (<archive>.grpidx), mapped as is by later opens :
+   header, then entries (struct grp_file) and name index (buckets, then
+   chain links), using native byte order and structure layout
+   It is tied to an archive by its size, modification time (with nanoseconds,
+   when available) and inode */
+#define GRPIDX_SUFFIX       ".grpidx"       /* index file name suffix */
+#define GRPIDX_MAGIC        "GRPIDX02"      /* magic */
+#define GRPIDX_MAGICLEN     8               /* magic length */
+#define GRPIDX_BYTEORDER    0x01020304      /* byte order check */
+struct grp_index_header {
+    char magic[GRPIDX_MAGICLEN];
+    uint32_t byte_order;                    /* GRPIDX_BYTEORDER */
+    uint32_t entry_size;                    /* sizeof(struct grp_file) */
+    uint64_t archive_size;                  /* archive key */
+    int64_t archive_mtime;
+    int64_t archive_mtime_nsec;
+    uint64_t archive_dev;
+    uint64_t archive_ino;
+    uint32_t num_files;                     /* number of entries */
+    uint32_t num_buckets;                   /* number of buckets */
+};
+
+/* Archive access engines */
+#define ENGINE_FD               0           /* pread(2) */
+#define ENGINE_MMAP             1           /* mmap(2), falls back to fd */
+
+static void uninit_grp_files(struct grp_archive *archive);
+
+/* Data copy strategies, from fastest to slowest */
+#define COPY_COPY_FILE_RANGE    0           /* in-kernel, may reflink */
+#define COPY_SENDFILE           1           /* in-kernel */
+#define COPY_READ_WRITE         2           /* through a userland buffer */
+#define COPY_MMAP               3           /* single write(2) from mapping */
+#define COPY_SPLICE             4           /* in-kernel, from a pipe */
+#define COPY_IO_URING           5           /* batched, through io_uring(7) */
+static const char *copy_strategy_names[] = {
+    "copy_file_range", "sendfile", "read/write", "mmap", "splice", "io_uring"
+};
+#define COPY_BUFSIZE            (1024 * 1024) /* read/write buffer size */
+#define COPY_MAXCHUNK           (1024 * 1024 * 1024) /* max bytes per call */
+
+
+/* Read size bytes from src_handle, retrying on short reads (pipes)
+   Returns the number of bytes read (less than size on end of file) or -1
+   on error */
+static ssize_t
+read_full(int src_handle, void *buf, size_t size)
+{
+    char *p = buf;
+    size_t done = 0;
+
+    while(done < size) {
+        ssize_t bytes = read(src_handle, p + done, size - done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        if(bytes == 0)
+            break;
+        done += bytes;
+    }
+    return (done);
+}
+
+/* Map group archive into memory
+   Leaves archive->map to NULL if archive cannot be mapped */
+static void
+map_grp_archive(struct grp_archive *archive)
+{
+#if defined(HAVE_MMAP)
+    struct stat archive_stat;
+    void *map;
+
+    if((fstat(archive->handle, &archive_stat) < 0) ||
+        !S_ISREG(archive_stat.st_mode) || (archive_stat.st_size <= 0) ||
+        ((uint64_t)archive_stat.st_size > SIZE_MAX))
+        return;
+
+    if((map = mmap(NULL, (size_t)archive_stat.st_size, PROT_READ, MAP_SHARED,
+        archive->handle, 0)) == MAP_FAILED)
+        return;
+
+    archive->map = map;
+    archive->map_size = (size_t)archive_stat.st_size;
+#endif
+    return;
+}
+
+/* Give the kernel a hint about how an archive range will be accessed,
+   through madvise(2) if archive is mapped or posix_fadvise(2) (advice being
+   one of GRP_ADVICE_* values, length 0 meaning up to end of archive) */
+static void
+advise_grp_archive(struct grp_archive *archive, uint64_t offset,
+    uint64_t length, int advice)
+{
+#if defined(HAVE_MMAP)
+    if(archive->map != NULL) {
+        uint64_t aligned_offset;
+
+        if(offset >= archive->map_size)
+            return;
+
+        /* madvise(2) wants a page-aligned address */
+        aligned_offset = offset - (offset % sysconf(_SC_PAGESIZE));
+        length += offset - aligned_offset;
+        if((length == offset - aligned_offset) ||
+            (length > archive->map_size - aligned_offset))
+            length = archive->map_size - aligned_offset;
+
+        madvise(archive->map + aligned_offset, length,
+            (advice == GRP_ADVICE_SEQUENTIAL) ? MADV_SEQUENTIAL :
+            (advice == GRP_ADVICE_RANDOM) ? MADV_RANDOM : MADV_WILLNEED);
+        return;
+    }
+#endif
+#if defined(HAVE_POSIX_FADVISE)
+    if(!archive->streaming)
+        posix_fadvise(archive->handle, offset, length,
+            (advice == GRP_ADVICE_SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL :
+            (advice == GRP_ADVICE_RANDOM) ? POSIX_FADV_RANDOM :
+            POSIX_FADV_WILLNEED);
+#endif
+    return;
+}
+
+#if defined(HAVE_MMAP)
+/* Fill an index file header (except counts) from archive's metadata */
+static void
+key_grp_index_file(const struct stat *archive_stat,
+    struct grp_index_header *header)
+{
+    memset(header, 0, sizeof(struct grp_index_header));
+    memcpy(&header->magic[0], GRPIDX_MAGIC, GRPIDX_MAGICLEN);
+    header->byte_order = GRPIDX_BYTEORDER;
+    header->entry_size = sizeof(struct grp_file);
+    header->archive_size = archive_stat->st_size;
+    header->archive_mtime = archive_stat->st_mtime;
+#if defined(__linux__)
+    header->archive_mtime_nsec = archive_stat->st_mtim.tv_nsec;
+#elif defined(__FreeBSD__)
+    header->archive_mtime_nsec = archive_stat->st_mtimespec.tv_nsec;
+#endif
+    header->archive_dev = archive_stat->st_dev;
+    header->archive_ino = archive_stat->st_ino;
+    return;
+}
+
+/* Map an index file matching archive, whose entries and name index are
+   then used in place
+   Returns 0 on success, -1 if index file is missing, invalid or stale */
+static int
+map_grp_index_file(struct grp_archive *archive, const char *idx_filename)
+{
+    struct stat archive_stat, idx_stat;
+    struct grp_index_header key;
+    const struct grp_index_header *header;
+    struct grp_file *files;
+    const uint32_t *buckets, *chain;
+    unsigned char *map;
+    uint64_t file_offset;
+    uint32_t i;
+    int idx_handle;
+
+    if((fstat(archive->handle, &archive_stat) < 0) ||
+        !S_ISREG(archive_stat.st_mode))
+        return (-1);
+    key_grp_index_file(&archive_stat, &key);
+
+    if((idx_handle = open(idx_filename, O_RDONLY|O_BINARY)) < 0)
+        return (-1);
+    if((fstat(idx_handle, &idx_stat) < 0) ||
+        ((uint64_t)idx_stat.st_size < sizeof(struct grp_index_header)) ||
+        ((uint64_t)idx_stat.st_size > SIZE_MAX) ||
+        ((map = mmap(NULL, (size_t)idx_stat.st_size, PROT_READ, MAP_SHARED,
+        idx_handle, 0)) == MAP_FAILED)) {
+        close(idx_handle);
+        return (-1);
+    }
+    close(idx_handle);
+
+    /* Check index file belongs to archive, and its size */
+    header = (const struct grp_index_header *)map;
+    if((memcmp(&header->magic[0], &key.magic[0], GRPIDX_MAGICLEN) != 0) ||
+        (header->byte_order != key.byte_order) ||
+        (header->entry_size != key.entry_size) ||
+        (header->archive_size != key.archive_size) ||
+        (header->archive_mtime != key.archive_mtime) ||
+        (header->archive_mtime_nsec != key.archive_mtime_nsec) ||
+        (header->archive_dev != key.archive_dev) ||
+        (header->archive_ino != key.archive_ino) ||
+        (header->num_buckets == 0) ||
+        ((header->num_buckets & (header->num_buckets - 1)) != 0) ||
+        ((uint64_t)idx_stat.st_size != sizeof(struct grp_index_header) +
+        (uint64_t)header->num_files * sizeof(struct grp_file) +
+        ((uint64_t)header->num_buckets + header->num_files) *
+        sizeof(uint32_t))) {
+        munmap(map, (size_t)idx_stat.st_size);
+        return (-1);
+    }
+
+    /* Entries are trusted from now on, make sure they are consistent */
+    files = (struct grp_file *)(map + sizeof(struct grp_index_header));
+    file_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+        (uint64_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) *
+        header->num_files;
+    for(i = 0 ; i < header->num_files ; i++) {
+        if((files[i].index != i + 1) ||
+            (files[i].file_name[GRPHDR_FILENAMELEN] != '\0') ||
+            (files[i].file_offset != file_offset)) {
+            munmap(map, (size_t)idx_stat.st_size);
+            return (-1);
+        }
+        file_offset += files[i].file_size;
+    }
+
+    /* Name index is built back to front : bucket heads and chain links
+       point to later entries, so that lookups cannot loop */
+    buckets = (const uint32_t *)&files[header->num_files];
+    chain = buckets + header->num_buckets;
+    for(i = 0 ; i < header->num_buckets ; i++) {
+        if(buckets[i] > header->num_files) {
+            munmap(map, (size_t)idx_stat.st_size);
+            return (-1);
+        }
+    }
+    for(i = 0 ; i < header->num_files ; i++) {
+        if((chain[i] != 0) &&
+            ((chain[i] <= i + 1) || (chain[i] > header->num_files))) {
+            munmap(map, (size_t)idx_stat.st_size);
+            return (-1);
+        }
+    }
+
+    archive->idx_map = map;
+    archive->idx_map_size = (size_t)idx_stat.st_size;
+    archive->files = files;
+    archive->num_files = header->num_files;
+    archive->index.num_files = header->num_files;
+    archive->index.num_buckets = header->num_buckets;
+    archive->index.buckets = (uint32_t *)&files[header->num_files];
+    archive->index.chain = archive->index.buckets + header->num_buckets;
+    archive->stream_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+        (uint64_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) *
+        header->num_files;
+    return (0);
+}
+
+/* Write an index file for archive, through a temporary file renamed into
+   place so that readers never see a partial one
+   Entries are copied to zeroed ones first, so that structure padding does
+   not end up in the file
+   Failures are silently ignored, index file being a mere cache */
+static void
+write_grp_index_file(struct grp_archive *archive, const char *idx_filename)
+{
+    struct stat archive_stat;
+    struct grp_index_header header;
+    struct grp_file *entries;
+    char *tmp_filename;
+    int tmp_file_handle;
+    uint32_t i;
+
+    if((archive->streaming) || (fstat(archive->handle, &archive_stat) < 0) ||
+        !S_ISREG(archive_stat.st_mode))
+        return;
+    key_grp_index_file(&archive_stat, &header);
+    header.num_files = archive->num_files;
+    header.num_buckets = archive->index.num_buckets;
+
+    if((entries = calloc(archive->num_files > 0 ? archive->num_files : 1,
+        sizeof(struct grp_file))) == NULL)
+        return;
+    for(i = 0 ; i < archive->num_files ; i++) {
+        entries[i].index = archive->files[i].index;
+        memcpy(&entries[i].file_name[0], &archive->files[i].file_name[0],
+            sizeof(entries[i].file_name));
+        entries[i].file_size = archive->files[i].file_size;
+        entries[i].file_offset = archive->files[i].file_offset;
+    }
+
+    if((tmp_filename = malloc(strlen(idx_filename) + strlen(".XXXXXX") + 1))
+        == NULL) {
+        free(entries);
+        return;
+    }
+    strcpy(tmp_filename, idx_filename);
+    strcat(tmp_filename, ".XXXXXX");
+    if((tmp_file_handle = mkstemp(tmp_filename)) < 0) {
+        free(tmp_filename);
+        free(entries);
+        return;
+    }
+    fchmod(tmp_file_handle, archive_stat.st_mode & 0666);
+
+    if((grp_write_full(tmp_file_handle, &header, sizeof(header)) < 0) ||
+        (grp_write_full(tmp_file_handle, entries,
+        sizeof(struct grp_file) * archive->num_files) < 0) ||
+        (grp_write_full(tmp_file_handle, archive->index.buckets,
+        sizeof(uint32_t) * archive->index.num_buckets) < 0) ||
+        (grp_write_full(tmp_file_handle, archive->index.chain,
+        sizeof(uint32_t) * archive->num_files) < 0) ||
+        (close(tmp_file_handle) < 0) ||
+        (rename(tmp_filename, idx_filename) < 0)) {
+        close(tmp_file_handle);
+        unlink(tmp_filename);
+    }
+    free(tmp_filename);
+    free(entries);
+    return;
+}
+#endif
+
+/* Detect compression format from the first COMPRESS_MAGICLEN bytes of an
+   archive
+   Returns COMPRESS_* format */
+static int
+detect_compression(const unsigned char *buf, size_t size)
+{
+    if(size < COMPRESS_MAGICLEN)
+        return (COMPRESS_NONE);
+    if((buf[0] == 0x1f) && (buf[1] == 0x8b))
+        return (COMPRESS_GZIP);
+    if((buf[0] == 0x28) && (buf[1] == 0xb5) && (buf[2] == 0x2f) &&
+        (buf[3] == 0xfd))
+        return (COMPRESS_ZSTD);
+    return (COMPRESS_NONE);
+}
+
+/* Tell if compression format can be decoded by this build */
+static int
+compression_supported(int format)
+{
+    switch(format) {
+#if defined(HAVE_DECOMPRESS) && defined(WITH_ZLIB)
+        case COMPRESS_GZIP:
+            return (1);
+#endif
+#if defined(HAVE_DECOMPRESS) && defined(WITH_ZSTD)
+        case COMPRESS_ZSTD:
+            return (1);
+#endif
+        default:
+            return (0);
+    }
+}
+
+#if defined(HAVE_DECOMPRESS)
+/* Compressed archive decoder : a thread reads compressed archive and writes
+   decoded data to a pipe, which is then read as a forward-only archive
+   (i.e. members are extracted in directory order, while next ones are
+   being decoded) */
+#define DECODE_BUFSIZE      (256 * 1024)    /* input and output buffer size */
+#define DECODE_PIPESIZE     (1024 * 1024)   /* pipe buffer size, if settable */
+struct grp_decoder {
+    pthread_t thread;
+    int format;                             /* COMPRESS_* */
+    int src_handle;                         /* compressed archive */
+    uint8_t close_src;                      /* src_handle belongs to decoder */
+    int dst_handle;                         /* pipe write end */
+    unsigned char prefix[COMPRESS_MAGICLEN]; /* bytes already read from src */
+    size_t prefix_len;
+    unsigned char *in_buf;                  /* compressed data */
+    unsigned char *out_buf;                 /* decoded data */
+};
+
+/* Read compressed data, starting with bytes already read by detection
+   Returns the number of bytes read (0 on end of file) or -1 on error */
+static ssize_t
+read_compressed(struct grp_decoder *decoder)
+{
+    size_t done = decoder->prefix_len;
+    ssize_t bytes;
+
+    memcpy(decoder->in_buf, decoder->prefix, done);
+    decoder->prefix_len = 0;
+    if((bytes = read_full(decoder->src_handle, decoder->in_buf + done,
+        DECODE_BUFSIZE - done)) < 0)
+        return (-1);
+    return (done + bytes);
+}
+
+#if defined(WITH_ZLIB)
+/* Decode a gzip stream (possibly made of several members)
+   Returns 0 on success (or if reader went away), -1 on error */
+static int
+decode_gzip(struct grp_decoder *decoder)
+{
+    z_stream stream;
+    ssize_t bytes;
+    int ret;
+    int more = 0;                           /* output buffer was filled */
+    int ended = 0;                          /* member ended (none pending) */
+
+    memset(&stream, 0, sizeof(stream));
+    if(inflateInit2(&stream, 15 + 16) != Z_OK)
+        return (-1);
+
+    for(;;) {
+        if((stream.avail_in == 0) && !more) {
+            if((bytes = read_compressed(decoder)) < 0)
+                break;
+            if(bytes == 0) {
+                ret = ended ? 0 : -1;
+                goto end;
+            }
+            stream.next_in = decoder->in_buf;
+            stream.avail_in = bytes;
+        }
+
+        /* Another member follows (concatenated gzip files) */
+        if(ended) {
+            if(inflateReset(&stream) != Z_OK)
+                break;
+            ended = 0;
+        }
+
+        stream.next_out = decoder->out_buf;
+        stream.avail_out = DECODE_BUFSIZE;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if((ret == Z_BUF_ERROR) && (stream.avail_in == 0)) {
+            /* Needs more input */
+            more = 0;
+            continue;
+        }
+        if((ret != Z_OK) && (ret != Z_STREAM_END))
+            break;
+        if(grp_write_full(decoder->dst_handle, decoder->out_buf,
+            DECODE_BUFSIZE - stream.avail_out) < 0) {
+            ret = (errno == EPIPE) ? 0 : -1;
+            goto end;
+        }
+        ended = (ret == Z_STREAM_END);
+        more = !ended && (stream.avail_out == 0);
+    }
+    ret = -1;
+
+end:
+    inflateEnd(&stream);
+    return (ret);
+}
+#endif
+
+#if defined(WITH_ZSTD)
+/* Decode a zstd stream (possibly made of several frames)
+   Returns 0 on success (or if reader went away), -1 on error */
+static int
+decode_zstd(struct grp_decoder *decoder)
+{
+    ZSTD_DStream *stream;
+    ZSTD_inBuffer input = { decoder->in_buf, 0, 0 };
+    ZSTD_outBuffer output;
+    ssize_t bytes;
+    size_t hint = 0;                        /* 0 once a frame is complete */
+    int ret = -1;
+    int more = 0;                           /* output buffer was filled */
+
+    if((stream = ZSTD_createDStream()) == NULL)
+        return (-1);
+    if(ZSTD_isError(ZSTD_initDStream(stream)))
+        goto end;
+
+    for(;;) {
+        if((input.pos == input.size) && !more) {
+            if((bytes = read_compressed(decoder)) < 0)
+                goto end;
+            if(bytes == 0) {
+                ret = (hint == 0) ? 0 : -1;
+                goto end;
+            }
+            input.size = bytes;
+            input.pos = 0;
+        }
+
+        output.dst = decoder->out_buf;
+        output.size = DECODE_BUFSIZE;
+        output.pos = 0;
+        hint = ZSTD_decompressStream(stream, &output, &input);
+        if(ZSTD_isError(hint))
+            goto end;
+        if(grp_write_full(decoder->dst_handle, decoder->out_buf,
+            output.pos) < 0) {
+            ret = (errno == EPIPE) ? 0 : -1;
+            goto end;
+        }
+        more = (output.pos == output.size);
+    }
+
+end:
+    ZSTD_freeDStream(stream);
+    return (ret);
+}
+#endif
+
+/* Decoder thread : decode archive, then close pipe (reader then gets an end
+   of file, premature if archive could not be decoded) */
+static void *
+run_grp_decoder(void *arg)
+{
+    struct grp_decoder *decoder = arg;
+    sigset_t sigset;
+    int ret = -1;
+
+    /* Reader may stop early : get EPIPE rather than SIGPIPE */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    switch(decoder->format) {
+#if defined(WITH_ZLIB)
+        case COMPRESS_GZIP:
+            ret = decode_gzip(decoder);
+            break;
+#endif
+#if defined(WITH_ZSTD)
+        case COMPRESS_ZSTD:
+            ret = decode_zstd(decoder);
+            break;
+#endif
+        default:
+            break;
+    }
+    if(ret < 0)
+        fprintf(stderr, "cannot decode %s compressed group archive\n",
+            compress_format_names[decoder->format]);
+
+    close(decoder->dst_handle);
+    decoder->dst_handle = -1;
+    return (NULL);
+}
+
+/* Start decoding archive (whose first prefix_len bytes have already been
+   read into prefix), making archive a forward-only one reading decoded data
+   Returns 0 on success, -1 on error */
+static int
+start_grp_decoder(struct grp_archive *archive, int format,
+    const unsigned char *prefix, size_t prefix_len)
+{
+    struct grp_decoder *decoder;
+    int pipe_handles[2];
+
+    if((decoder = calloc(1, sizeof(struct grp_decoder))) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    if(((decoder->in_buf = malloc(DECODE_BUFSIZE)) == NULL) ||
+        ((decoder->out_buf = malloc(DECODE_BUFSIZE)) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        goto error;
+    }
+    if(pipe(pipe_handles) < 0) {
+        fprintf(stderr, "cannot create pipe\n");
+        goto error;
+    }
+#if defined(F_SETPIPE_SZ)
+    /* Let decoder run further ahead of reader (best effort) */
+    fcntl(pipe_handles[1], F_SETPIPE_SZ, DECODE_PIPESIZE);
+#endif
+
+    decoder->format = format;
+    decoder->src_handle = archive->handle;
+    decoder->close_src = !archive->streaming;
+    decoder->dst_handle = pipe_handles[1];
+    memcpy(decoder->prefix, prefix, prefix_len);
+    decoder->prefix_len = prefix_len;
+
+    if(pthread_create(&decoder->thread, NULL, run_grp_decoder, decoder) != 0) {
+        fprintf(stderr, "cannot create decoder thread\n");
+        close(pipe_handles[0]);
+        close(pipe_handles[1]);
+        goto error;
+    }
+
+    /* Compressed archive is now read by decoder */
+    archive->handle = pipe_handles[0];
+    archive->streaming = 1;
+    archive->decoder = decoder;
+    return (0);
+
+error:
+    free(decoder->in_buf);
+    free(decoder->out_buf);
+    free(decoder);
+    return (-1);
+}
+
+/* Stop decoding archive, reader must have closed its end of pipe first */
+static void
+stop_grp_decoder(struct grp_decoder *decoder)
+{
+    pthread_join(decoder->thread, NULL);
+    if(decoder->close_src)
+        close(decoder->src_handle);
+    free(decoder->in_buf);
+    free(decoder->out_buf);
+    free(decoder);
+    return;
+}
+#endif
+
+/* Initialize grp_file structures from a grp file, using given engine
+   (ENGINE_MMAP falling back to ENGINE_FD if archive cannot be mapped)
+   Fills archive with a file handle on group file as well as an array of
+   entries found in archive (to be freed by uninit_grp_files())
+   If idx_filename is not NULL and names a valid index file for archive,
+   entries and name index are taken from it instead */
+static int
+init_grp_files(const char *filename, uint8_t engine,
+    const char *idx_filename, struct grp_archive *archive)
+{
+    /* Main header */
+    char headbuf[GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN];
+
+    size_t head_done = 0;                   /* bytes already read */
+
+    /* Per-file headers, read at once */
+    char *filebuf = NULL;
+    size_t filebuf_size;
+    uint64_t file_offset;
+
+    /* Compression detection */
+    ssize_t peeked;
+    int format;
+
+    if((filename == NULL) || (archive == NULL)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    archive->map = NULL;
+    archive->map_size = 0;
+    archive->files = NULL;
+    archive->num_files = 0;
+    archive->index.num_files = 0;
+    archive->index.num_buckets = 0;
+    archive->index.buckets = archive->index.chain = NULL;
+    archive->stream_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN;
+    archive->stream_buf = NULL;
+    archive->idx_map = NULL;
+    archive->idx_map_size = 0;
+    archive->decoder = NULL;
+
+    /* Open group archive, '-' meaning a forward-only standard input */
+    archive->streaming = (strcmp(filename, "-") == 0);
+    if(archive->streaming)
+        archive->handle = STDIN_FILENO;
+    else if((archive->handle = open(filename, O_RDONLY|O_BINARY)) < 0) {
+        fprintf(stderr, "cannot open group archive : %s\n", filename);
+        return (-1);
+    }
+
+    /* Look for a compressed archive, which is then decoded on the fly
+       (standard input cannot be peeked at : bytes read there are part of
+       main header if archive is not compressed) */
+    if(archive->streaming)
+        peeked = read_full(archive->handle, &headbuf[0], COMPRESS_MAGICLEN);
+    else
+        peeked = pread(archive->handle, &headbuf[0], COMPRESS_MAGICLEN, 0);
+    if(peeked < 0)
+        peeked = 0;
+    format = detect_compression((unsigned char *)&headbuf[0], peeked);
+    if(archive->streaming)
+        head_done = peeked;
+    if(format != COMPRESS_NONE) {
+        if(!compression_supported(format)) {
+            fprintf(stderr,
+                "%s compressed group archives not supported : %s\n",
+                compress_format_names[format], filename);
+            uninit_grp_files(archive);
+            return (-1);
+        }
+#if defined(HAVE_DECOMPRESS)
+        if(start_grp_decoder(archive, format, (unsigned char *)&headbuf[0],
+            head_done) < 0) {
+            uninit_grp_files(archive);
+            return (-1);
+        }
+#endif
+        head_done = 0;
+    }
+
+    if((engine == ENGINE_MMAP) && !archive->streaming)
+        map_grp_archive(archive);
+
+#if defined(HAVE_MMAP)
+    /* Directory already decoded and indexed by a previous run */
+    if((idx_filename != NULL) && !archive->streaming &&
+        (map_grp_index_file(archive, idx_filename) == 0))
+        return (0);
+#endif
+
+    /* Read main header */
+    if(archive->map != NULL) {
+        if(archive->map_size < (GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN)) {
+            fprintf(stderr, "group archive header truncated\n");
+            uninit_grp_files(archive);
+            return (-1);
+        }
+        memcpy(&headbuf[0], archive->map,
+            GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN);
+    }
+    else if(read_full(archive->handle, &headbuf[head_done],
+        GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN - head_done)
+        < (ssize_t)(GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN - head_done)) {
+        fprintf(stderr, "group archive header truncated\n");
+        uninit_grp_files(archive);
+        return (-1);
+    }
+
+    /* Check file type */
+    if(strncmp(&headbuf[0], GRPHDR_MAGIC, GRPHDR_MAGICLEN) != 0) {
+        fprintf(stderr, "unrecognized group archive : %s\n", filename);
+        uninit_grp_files(archive);
+        return (-1);
+    }
+
+    /* Get number of files */
+    archive->num_files = le32toh(*((uint32_t *)&headbuf[GRPHDR_MAGICLEN]));
+    if(archive->num_files == 0)
+        return (0);
+
+    /* Allocate entries as well as a buffer holding the whole directory
+       (sizes may only overflow a 32-bit size_t) */
+#if SIZE_MAX < UINT64_MAX
+    if((archive->num_files > SIZE_MAX / sizeof(struct grp_file)) ||
+        (archive->num_files >
+        SIZE_MAX / (GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN))) {
+        fprintf(stderr, "too many files in group archive\n");
+        uninit_grp_files(archive);
+        return (-1);
+    }
+#endif
+    filebuf_size =
+        (size_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * archive->num_files;
+    if((archive->files =
+        malloc(sizeof(struct grp_file) * archive->num_files)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        uninit_grp_files(archive);
+        return (-1);
+    }
+
+    /* Get group archive's directory in a single pass, either straight from
+       the mapping or through a single read */
+    if(archive->map != NULL) {
+        if(archive->map_size - (GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN) <
+            filebuf_size) {
+            fprintf(stderr, "group archive header truncated\n");
+            uninit_grp_files(archive);
+            return (-1);
+        }
+        advise_grp_archive(archive, GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN,
+            filebuf_size, GRP_ADVICE_WILLNEED);
+        filebuf = (char *)archive->map + GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN;
+    }
+    else {
+        if((filebuf = malloc(filebuf_size)) == NULL) {
+            fprintf(stderr, "cannot allocate memory\n");
+            uninit_grp_files(archive);
+            return (-1);
+        }
+        if(read_full(archive->handle, filebuf, filebuf_size) <
+            (ssize_t)filebuf_size) {
+            fprintf(stderr, "group archive header truncated\n");
+            free(filebuf);
+            uninit_grp_files(archive);
+            return (-1);
+        }
+    }
+
+    /* Decode entries, data starts right after the directory */
+    file_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN + filebuf_size;
+    archive->stream_offset = file_offset;
+    uint32_t i = 0;
+    while(i < archive->num_files) {
+        struct grp_file *current = &archive->files[i];
+        char *entry = &filebuf[(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * i];
+
+        current->index = i + 1;
+        strncpy(&current->file_name[0], entry, GRPHDR_FILENAMELEN);
+        current->file_name[GRPHDR_FILENAMELEN] = '\0';
+        current->file_size =
+            le32toh(*((uint32_t *)&entry[GRPHDR_FILENAMELEN]));
+        current->file_offset = file_offset;
+        file_offset += current->file_size;
+
+        i++;
+    }
+    if(archive->map == NULL)
+        free(filebuf);
+    return (0);
+}
+
+/* Un-initialize grp_file structures */
+static void
+uninit_grp_files(struct grp_archive *archive)
+{
+#if defined(HAVE_MMAP)
+    /* Entries and name index then live in the mapped index file */
+    if(archive->idx_map != NULL) {
+        munmap(archive->idx_map, archive->idx_map_size);
+        archive->files = NULL;
+        archive->index.buckets = archive->index.chain = NULL;
+        archive->index.num_buckets = archive->index.num_files = 0;
+    }
+#endif
+    archive->idx_map = NULL;
+    archive->idx_map_size = 0;
+
+    free(archive->files);
+    archive->files = NULL;
+    archive->num_files = 0;
+
+#if defined(HAVE_MMAP)
+    if(archive->map != NULL)
+        munmap(archive->map, archive->map_size);
+#endif
+    archive->map = NULL;
+    archive->map_size = 0;
+
+    free(archive->stream_buf);
+    archive->stream_buf = NULL;
+
+#if defined(HAVE_DECOMPRESS)
+    /* Closing pipe first makes decoder stop */
+    if(archive->decoder != NULL) {
+        close(archive->handle);
+        archive->handle = -1;
+        stop_grp_decoder(archive->decoder);
+    }
+#endif
+    archive->decoder = NULL;
+
+    if((archive->handle >= 0) && !archive->streaming)
+        close(archive->handle);
+    archive->handle = -1;
+    return;
+}
+
+/* Hash a file name, case-insensitively (as the Build engine does),
+   considering at most GRPHDR_FILENAMELEN characters */
+static uint32_t
+hash_file_name(const char *name)
+{
+    uint32_t hash = 2166136261U; /* FNV-1a */
+    int i;
+
+    for(i = 0 ; (i < GRPHDR_FILENAMELEN) && (name[i] != '\0') ; i++) {
+        hash ^= (uint32_t)toupper((unsigned char)name[i]);
+        hash *= 16777619U;
+    }
+    return (hash);
+}
+
+/* Compare two file names, case-insensitively
+   Returns 0 if they match */
+static int
+compare_file_names(const char *a, const char *b)
+{
+    while((*a != '\0') &&
+        (toupper((unsigned char)*a) == toupper((unsigned char)*b))) {
+        a++;
+        b++;
+    }
+    return (toupper((unsigned char)*a) - toupper((unsigned char)*b));
+}
+
+/* Build a name index over grp_file structures */
+static int
+init_grp_index(struct grp_file *files, uint32_t num_files,
+    struct grp_index *index)
+{
+    uint32_t i;
+
+    if(((files == NULL) && (num_files > 0)) || (index == NULL)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    /* Keep load factor below 1 */
+    index->num_files = num_files;
+    index->num_buckets = 1;
+    while((index->num_buckets < num_files) &&
+        (index->num_buckets < (UINT32_C(1) << 31)))
+        index->num_buckets <<= 1;
+
+    index->buckets = calloc(index->num_buckets, sizeof(uint32_t));
+    index->chain = malloc(sizeof(uint32_t) * (num_files > 0 ? num_files : 1));
+    if((index->buckets == NULL) || (index->chain == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(index->buckets);
+        free(index->chain);
+        index->buckets = index->chain = NULL;
+        return (-1);
+    }
+
+    /* Insert backwards so that, in case of duplicates, lookups return the
+       first entry of the archive */
+    for(i = num_files ; i > 0 ; i--) {
+        uint32_t bucket =
+            hash_file_name(files[i - 1].file_name) & (index->num_buckets - 1);
+
+        index->chain[i - 1] = index->buckets[bucket];
+        index->buckets[bucket] = files[i - 1].index;
+    }
+    return (0);
+}
+
+/* Un-initialize a name index */
+static void
+uninit_grp_index(struct grp_index *index)
+{
+    free(index->buckets);
+    free(index->chain);
+    index->buckets = index->chain = NULL;
+    index->num_buckets = index->num_files = 0;
+    return;
+}
+
+/* Look a file up by name
+   Returns NULL if not found */
+static struct grp_file *
+lookup_grp_file(struct grp_file *files, const struct grp_index *index,
+    const char *lookup_filename)
+{
+    uint32_t next;
+
+    if(strlen(lookup_filename) > GRPHDR_FILENAMELEN)
+        return (NULL);
+
+    next = index->buckets[hash_file_name(lookup_filename) &
+        (index->num_buckets - 1)];
+    while((next != 0) && (next <= index->num_files)) {
+        if(compare_file_names(lookup_filename, files[next - 1].file_name)
+            == 0)
+            return (&files[next - 1]);
+        next = index->chain[next - 1];
+    }
+    return (NULL);
+}
+
+/* First strategy worth trying; each call degrades its own copy of it when a
+   strategy turns out to be unsupported for the files involved, so that
+   neither concurrent extractions nor other destinations are affected */
+#if defined(HAVE_COPY_FILE_RANGE)
+#define COPY_FIRST              COPY_COPY_FILE_RANGE
+#elif defined(HAVE_SENDFILE)
+#define COPY_FIRST              COPY_SENDFILE
+#else
+#define COPY_FIRST              COPY_READ_WRITE
+#endif
+
+/* Tell if errno reports a copy strategy unsupported for the files involved
+   (rather than an actual I/O error) */
+static int
+copy_unsupported(int error)
+{
+    return ((error == ENOSYS) || (error == EXDEV) || (error == EINVAL) ||
+        (error == EOPNOTSUPP) || (error == EBADF));
+}
+
+/* Copy size bytes from src_handle at src_offset to dst_handle's current
+   position, using the fastest strategy available
+   Sets *strategy to the last strategy used
+   Returns the number of bytes copied (less than size if source is
+   truncated) or -1 on error */
+static int64_t
+copy_file_data(int src_handle, off_t src_offset, int dst_handle,
+    uint64_t size, int *strategy)
+{
+    uint64_t copied = 0;
+    char *buf = NULL;
+
+    *strategy = COPY_FIRST;
+    while(copied < size) {
+        ssize_t bytes = -1;
+        size_t chunk = (size - copied > COPY_MAXCHUNK) ?
+            COPY_MAXCHUNK : (size_t)(size - copied);
+
+        switch(*strategy) {
+#if defined(HAVE_COPY_FILE_RANGE)
+            case COPY_COPY_FILE_RANGE:
+            {
+                off_t in_offset = src_offset + copied;
+
+                bytes = copy_file_range(src_handle, &in_offset, dst_handle,
+                    NULL, chunk, 0);
+                break;
+            }
+#endif
+#if defined(HAVE_SENDFILE)
+            case COPY_SENDFILE:
+            {
+                off_t in_offset = src_offset + copied;
+
+                bytes = sendfile(dst_handle, src_handle, &in_offset, chunk);
+                break;
+            }
+#endif
+            case COPY_READ_WRITE:
+            default:
+            {
+                size_t bufsize = (chunk > COPY_BUFSIZE) ?
+                    COPY_BUFSIZE : chunk;
+
+                if((buf == NULL) && ((buf = malloc(bufsize)) == NULL)) {
+                    fprintf(stderr, "cannot allocate memory\n");
+                    return (-1);
+                }
+                if((bytes = pread(src_handle, buf, bufsize,
+                    src_offset + copied)) > 0) {
+                    if(grp_write_full(dst_handle, buf, bytes) < 0) {
+                        free(buf);
+                        return (-1);
+                    }
+                }
+                break;
+            }
+        }
+
+        if(bytes > 0)
+            copied += bytes;
+        else if(bytes == 0)
+            break; /* source truncated */
+        else if(errno == EINTR)
+            continue;
+        else if((*strategy != COPY_READ_WRITE) && copy_unsupported(errno)) {
+            /* Fall back to next strategy for the rest of this copy
+               (nothing has been copied by the failed call) */
+            (*strategy)++;
+        }
+        else {
+            free(buf);
+            return (-1);
+        }
+    }
+    free(buf);
+    return (copied);
+}
+
+/* Write size bytes of a mapped archive, from offset, to dst_handle
+   Returns the number of bytes written (less than size if archive is
+   truncated) or -1 on error */
+static int64_t
+write_mapped_data(struct grp_archive *archive, uint64_t offset, int dst_handle,
+    uint32_t size)
+{
+    uint32_t available = 0;
+    uint32_t written = 0;
+
+    if(offset < archive->map_size)
+        available = ((uint64_t)size > archive->map_size - offset) ?
+            (uint32_t)(archive->map_size - offset) : size;
+
+    while(written < available) {
+        ssize_t bytes = write(dst_handle, archive->map + offset + written,
+            available - written);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        written += bytes;
+    }
+    return (written);
+}
+
+/* Copy size bytes from a forward-only src_handle to dst_handle, or skip them
+   if dst_handle is -1, using buf (of bufsize bytes) when data has to go
+   through userland
+   Sets *strategy to the last strategy used
+   Returns the number of bytes consumed from src_handle (less than size if
+   source is truncated) or -1 on error */
+static int64_t
+stream_file_data(int src_handle, int dst_handle, uint64_t size, char *buf,
+    size_t bufsize, int *strategy)
+{
+    uint64_t copied = 0;
+
+#if defined(HAVE_SPLICE)
+    /* Move data from a pipe without copying it through userland (falling
+       back to read/write, for this call only, if source is not a pipe) */
+    *strategy = (dst_handle >= 0) ? COPY_SPLICE : COPY_READ_WRITE;
+#else
+    *strategy = COPY_READ_WRITE;
+#endif
+    while(copied < size) {
+        ssize_t bytes;
+        size_t chunk = (size - copied > COPY_MAXCHUNK) ?
+            COPY_MAXCHUNK : (size_t)(size - copied);
+
+#if defined(HAVE_SPLICE)
+        if(*strategy == COPY_SPLICE) {
+            if((bytes = splice(src_handle, NULL, dst_handle, NULL, chunk,
+                SPLICE_F_MOVE)) < 0) {
+                if(errno == EINTR)
+                    continue;
+                if(copy_unsupported(errno)) {
+                    /* Not a pipe, fall back to read/write */
+                    *strategy = COPY_READ_WRITE;
+                    continue;
+                }
+                return (-1);
+            }
+            if(bytes == 0)
+                break; /* source truncated */
+            copied += bytes;
+            continue;
+        }
+#endif
+        if((bytes = read_full(src_handle, buf,
+            (chunk > bufsize) ? bufsize : chunk)) < 0)
+            return (-1);
+        if((dst_handle >= 0) && (grp_write_full(dst_handle, buf, bytes) < 0))
+            return (-1);
+        copied += bytes;
+        if((size_t)bytes < ((chunk > bufsize) ? bufsize : chunk))
+            break; /* source truncated */
+    }
+    return (copied);
+}
+
+/* Return the base name of a path */
+static const char *
+path_base_name(const char *path)
+{
+    const char *base = path;
+
+    for(; *path != '\0' ; path++) {
+#if defined(_WIN32)
+        if((*path == '/') || (*path == '\\'))
+#else
+        if(*path == '/')
+#endif
+            base = path + 1;
+    }
+    return (base);
+}
+
+/* Check that a file can be stored into a group archive and fill the
+   corresponding entry (but its offset)
+   Returns 0 if file can be stored, -1 otherwise */
+static int
+stat_file_to_store(const char *path, struct grp_file *current,
+    struct stat *archive_stat)
+{
+    const char *name = path_base_name(path);
+    struct stat file_stat;
+
+    if((strlen(name) == 0) || (strlen(name) > GRPHDR_FILENAMELEN)) {
+        fprintf(stderr, "invalid file name (1 to %d characters allowed) : "
+            "%s\n", GRPHDR_FILENAMELEN, path);
+        return (-1);
+    }
+    if(stat(path, &file_stat) < 0) {
+        fprintf(stderr, "cannot stat file : %s\n", path);
+        return (-1);
+    }
+    if(!S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "not a regular file : %s\n", path);
+        return (-1);
+    }
+    if((uint64_t)file_stat.st_size > UINT32_MAX) {
+        fprintf(stderr, "file too large for a group archive (4 GiB max) : "
+            "%s\n", path);
+        return (-1);
+    }
+    if((archive_stat != NULL) && (file_stat.st_dev == archive_stat->st_dev) &&
+        (file_stat.st_ino == archive_stat->st_ino)) {
+        fprintf(stderr, "file is the group archive itself : %s\n", path);
+        return (-1);
+    }
+
+    strncpy(&current->file_name[0], name, GRPHDR_FILENAMELEN);
+    current->file_name[GRPHDR_FILENAMELEN] = '\0';
+    current->file_size = (uint32_t)file_stat.st_size;
+    return (0);
+}
+
+/* Copy a file's data to a group archive being written
+   Returns 0 on success, -1 on error */
+static int
+store_file_data(int grp_file_handle, const char *path,
+    struct grp_file *current, uint8_t verbose)
+{
+    int src_file_handle;
+    struct stat file_stat;
+    int64_t copied;
+    int strategy;
+
+    if((src_file_handle = open(path, O_RDONLY|O_BINARY)) < 0) {
+        fprintf(stderr, "cannot open file : %s\n", path);
+        return (-1);
+    }
+
+    /* Size must not have changed since TOC was written */
+    if((fstat(src_file_handle, &file_stat) < 0) ||
+        (file_stat.st_size != (off_t)current->file_size)) {
+        fprintf(stderr, "file changed while being archived : %s\n", path);
+        close(src_file_handle);
+        return (-1);
+    }
+
+    if(((copied = copy_file_data(src_file_handle, 0, grp_file_handle,
+        current->file_size, &strategy)) < 0) ||
+        (copied < current->file_size)) {
+        fprintf(stderr, "cannot copy file to group archive : %s\n", path);
+        close(src_file_handle);
+        return (-1);
+    }
+
+    if(verbose == 1)
+        fprintf(stdout, "%s (%s)\n", current->file_name,
+            copy_strategy_names[strategy]);
+
+    close(src_file_handle);
+    return (0);
+}
+
+/* Write group archive header and directory for given entries
+   Returns 0 on success, -1 on error */
+static int
+write_grp_toc(int grp_file_handle, struct grp_file *files,
+    uint32_t num_files)
+{
+    char *tocbuf;
+    size_t tocbuf_size;
+    uint32_t i;
+    int err;
+
+#if SIZE_MAX < UINT64_MAX
+    if((size_t)num_files > (SIZE_MAX - GRPHDR_MAGICLEN - GRPHDR_NUMFILESLEN) /
+        (GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN)) {
+        fprintf(stderr, "too many files for a group archive\n");
+        return (-1);
+    }
+#endif
+    tocbuf_size = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+        (size_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * num_files;
+    if((tocbuf = calloc(1, tocbuf_size)) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+
+    memcpy(&tocbuf[0], GRPHDR_MAGIC, GRPHDR_MAGICLEN);
+    *((uint32_t *)&tocbuf[GRPHDR_MAGICLEN]) = htole32(num_files);
+    for(i = 0 ; i < num_files ; i++) {
+        char *entry = &tocbuf[GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+            (GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * i];
+
+        /* Name is zero-filled, not necessarily zero-terminated */
+        memcpy(entry, &files[i].file_name[0],
+            strlen(&files[i].file_name[0]));
+        *((uint32_t *)&entry[GRPHDR_FILENAMELEN]) =
+            htole32(files[i].file_size);
+    }
+
+    /* Whole TOC is written at once */
+    err = grp_write_full(grp_file_handle, tocbuf, tocbuf_size);
+    free(tocbuf);
+    return (err);
+}
+
+/* Create a group archive from a list of files
+   Returns 0 on success, -1 on error (archive then being removed) */
+static int
+create_grp_archive(const char *filename, char **paths, int num_paths,
+    uint8_t verbose)
+{
+    int grp_file_handle;
+    struct stat archive_stat;
+    struct grp_file *files;
+    struct grp_index index;
+    uint64_t file_offset;
+    int i;
+
+    if((filename == NULL) || (paths == NULL) || (num_paths < 0) ||
+        ((uint64_t)num_paths > UINT32_MAX)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    if((files = malloc(sizeof(struct grp_file) *
+        (num_paths > 0 ? num_paths : 1))) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+
+    /* Group archive may already exist : it must not be archived itself */
+    if(stat(filename, &archive_stat) < 0)
+        archive_stat.st_ino = 0;
+
+    /* Gather sizes first, to be able to write the TOC up front */
+    file_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+        (uint64_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * num_paths;
+    for(i = 0 ; i < num_paths ; i++) {
+        if(stat_file_to_store(paths[i], &files[i],
+            (archive_stat.st_ino != 0) ? &archive_stat : NULL) < 0) {
+            free(files);
+            return (-1);
+        }
+        files[i].index = i + 1;
+        files[i].file_offset = file_offset;
+        file_offset += files[i].file_size;
+    }
+
+    /* Member names must be unique */
+    if(init_grp_index(files, num_paths, &index) < 0) {
+        free(files);
+        return (-1);
+    }
+    for(i = 0 ; i < num_paths ; i++) {
+        if(lookup_grp_file(files, &index, files[i].file_name) != &files[i]) {
+            fprintf(stderr, "duplicate file name in group archive : %s\n",
+                paths[i]);
+            uninit_grp_index(&index);
+            free(files);
+            return (-1);
+        }
+    }
+    uninit_grp_index(&index);
+
+    /* Write group archive */
+    if((grp_file_handle =
+        open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0660)) < 0) {
+        fprintf(stderr, "cannot create group archive : %s\n", filename);
+        free(files);
+        return (-1);
+    }
+    if(write_grp_toc(grp_file_handle, files, num_paths) < 0) {
+        fprintf(stderr, "cannot write group archive header : %s\n",
+            filename);
+        close(grp_file_handle);
+        unlink(filename);
+        free(files);
+        return (-1);
+    }
+    for(i = 0 ; i < num_paths ; i++) {
+        if(store_file_data(grp_file_handle, paths[i], &files[i], verbose)
+            < 0) {
+            close(grp_file_handle);
+            unlink(filename);
+            free(files);
+            return (-1);
+        }
+    }
+
+    free(files);
+    if(close(grp_file_handle) < 0) {
+        fprintf(stderr, "cannot write group archive : %s\n", filename);
+        unlink(filename);
+        return (-1);
+    }
+    return (0);
+}
+
+/* Create a temporary file next to filename
+   Returns a file handle and sets *tmp_filename (to be freed) */
+static int
+open_temp_file(const char *filename, char **tmp_filename)
+{
+    int tmp_file_handle;
+
+    if(((*tmp_filename) = malloc(strlen(filename) + strlen(".XXXXXX") + 1))
+        == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        return (-1);
+    }
+    strcpy(*tmp_filename, filename);
+    strcat(*tmp_filename, ".XXXXXX");
+
+#if defined(_WIN32)
+    if((_mktemp(*tmp_filename) == NULL) ||
+        ((tmp_file_handle = open(*tmp_filename,
+        O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0660)) < 0)) {
+#else
+    if((tmp_file_handle = mkstemp(*tmp_filename)) < 0) {
+#endif
+        fprintf(stderr, "cannot create temporary file : %s\n",
+            *tmp_filename);
+        free(*tmp_filename);
+        (*tmp_filename) = NULL;
+        return (-1);
+    }
+    return (tmp_file_handle);
+}
+
+/* Add files to an existing group archive, replacing members with the same
+   name if replace is set (refusing to add them otherwise)
+   A new archive is written next to the existing one and renamed over it :
+   only header and directory are rebuilt, untouched members being copied
+   in-kernel (when possible) as contiguous spans of the existing archive
+   Returns 0 on success, -1 on error (archive then being left unchanged) */
+static int
+update_grp_archive(const char *filename, char **paths, int num_paths,
+    uint8_t replace, uint8_t verbose)
+{
+    struct grp_archive archive;
+    struct grp_index index;
+    struct stat archive_stat;
+    struct grp_file *files = NULL;          /* new entries */
+    const char **sources = NULL;            /* new data for each entry */
+    uint32_t num_files;
+    struct grp_file current;
+    char *tmp_filename = NULL;
+    int tmp_file_handle = -1;
+    uint64_t file_offset;
+    uint32_t i;
+    int p;
+
+    if((filename == NULL) || (paths == NULL) || (num_paths < 0)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+
+    if(init_grp_files(filename, ENGINE_FD, NULL, &archive) < 0)
+        return (-1);
+    if(fstat(archive.handle, &archive_stat) < 0) {
+        fprintf(stderr, "cannot stat group archive : %s\n", filename);
+        uninit_grp_files(&archive);
+        return (-1);
+    }
+    if((uint64_t)archive.num_files + num_paths > UINT32_MAX) {
+        fprintf(stderr, "too many files for a group archive\n");
+        uninit_grp_files(&archive);
+        return (-1);
+    }
+
+    /* Start from existing entries, new ones being added at the end */
+    num_files = archive.num_files;
+    if(((files = malloc(sizeof(struct grp_file) *
+        (archive.num_files + num_paths + 1))) == NULL) ||
+        ((sources = calloc(archive.num_files + num_paths + 1,
+        sizeof(char *))) == NULL)) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(files);
+        uninit_grp_files(&archive);
+        return (-1);
+    }
+    if(archive.num_files > 0)
+        memcpy(files, archive.files,
+            sizeof(struct grp_file) * archive.num_files);
+
+    if(init_grp_index(archive.files, archive.num_files, &index) < 0)
+        goto error;
+    for(p = 0 ; p < num_paths ; p++) {
+        struct grp_file *existing;
+
+        if(stat_file_to_store(paths[p], &current, &archive_stat) < 0) {
+            uninit_grp_index(&index);
+            goto error;
+        }
+        if((existing = lookup_grp_file(archive.files, &index,
+            current.file_name)) != NULL) {
+            if(replace == 0) {
+                fprintf(stderr, "file already in group archive (use -u to "
+                    "replace it) : %s\n", paths[p]);
+                uninit_grp_index(&index);
+                goto error;
+            }
+            /* Replace in place, keeping archive's file name */
+            files[existing->index - 1].file_size = current.file_size;
+            sources[existing->index - 1] = paths[p];
+        }
+        else {
+            current.index = num_files + 1;
+            files[num_files] = current;
+            sources[num_files] = paths[p];
+            num_files++;
+        }
+    }
+    uninit_grp_index(&index);
+
+    /* New member names must be unique too */
+    if(init_grp_index(files, num_files, &index) < 0)
+        goto error;
+    for(i = archive.num_files ; i < num_files ; i++) {
+        if(lookup_grp_file(files, &index, files[i].file_name) != &files[i]) {
+            fprintf(stderr, "duplicate file name in group archive : %s\n",
+                sources[i]);
+            uninit_grp_index(&index);
+            goto error;
+        }
+    }
+    uninit_grp_index(&index);
+
+    /* Compute new offsets */
+    file_offset = GRPHDR_MAGICLEN + GRPHDR_NUMFILESLEN +
+        (uint64_t)(GRPHDR_FILENAMELEN + GRPHDR_FILESIZELEN) * num_files;
+    for(i = 0 ; i < num_files ; i++) {
+        files[i].file_offset = file_offset;
+        file_offset += files[i].file_size;
+    }
+
+    /* Write new archive */
+    if((tmp_file_handle = open_temp_file(filename, &tmp_filename)) < 0)
+        goto error;
+    if(write_grp_toc(tmp_file_handle, files, num_files) < 0) {
+        fprintf(stderr, "cannot write group archive header : %s\n",
+            tmp_filename);
+        goto error;
+    }
+    i = 0;
+    while(i < num_files) {
+        if(sources[i] != NULL) {
+            if(store_file_data(tmp_file_handle, sources[i], &files[i],
+                verbose) < 0)
+                goto error;
+            i++;
+        }
+        else {
+            /* Copy a span of untouched members at once */
+            uint32_t first = i;
+            uint64_t span_size = 0;
+            int64_t copied;
+            int strategy;
+
+            while((i < num_files) && (sources[i] == NULL))
+                span_size += files[i++].file_size;
+            if(((copied = copy_file_data(archive.handle,
+                archive.files[first].file_offset, tmp_file_handle, span_size,
+                &strategy)) < 0) || ((uint64_t)copied < span_size)) {
+                fprintf(stderr, "cannot copy group archive data "
+                    "(truncated archive ?) : %s\n", filename);
+                goto error;
+            }
+            if(verbose == 1)
+                fprintf(stdout, "%u unchanged files (%s)\n", i - first,
+                    copy_strategy_names[strategy]);
+        }
+    }
+
+#if !defined(_WIN32)
+    fchmod(tmp_file_handle, archive_stat.st_mode & 07777);
+#endif
+    if(close(tmp_file_handle) < 0) {
+        tmp_file_handle = -1;
+        fprintf(stderr, "cannot write group archive : %s\n", tmp_filename);
+        goto error;
+    }
+    tmp_file_handle = -1;
+    uninit_grp_files(&archive);
+#if defined(_WIN32)
+    unlink(filename);
+#endif
+    if(rename(tmp_filename, filename) < 0) {
+        fprintf(stderr, "cannot replace group archive : %s\n", filename);
+        unlink(tmp_filename);
+        free(tmp_filename);
+        free(sources);
+        free(files);
+        return (-1);
+    }
+
+    free(tmp_filename);
+    free(sources);
+    free(files);
+    return (0);
+
+error:
+    if(tmp_file_handle >= 0)
+        close(tmp_file_handle);
+    if(tmp_filename != NULL) {
+        unlink(tmp_filename);
+        free(tmp_filename);
+    }
+    free(sources);
+    free(files);
+    uninit_grp_files(&archive);
+    return (-1);
+}
+
+/* Skip data of a forward-only archive up to offset
+   Returns 0 on success, 1 if archive is truncated before offset, -1 on
+   error (e.g. offset already passed) */
+static int
+stream_seek(struct grp_archive *archive, uint64_t offset)
+{
+    int64_t skipped;
+    int strategy;
+
+    if(offset < archive->stream_offset) {
+        errno = ESPIPE;
+        return (-1);
+    }
+    if((skipped = stream_file_data(archive->handle, -1,
+        offset - archive->stream_offset, archive->stream_buf, COPY_BUFSIZE,
+        &strategy)) < 0)
+        return (-1);
+    archive->stream_offset += skipped;
+    return ((archive->stream_offset == offset) ? 0 : 1);
+}
+
+/* CRC32C (Castagnoli) table, built on first use by software
+   implementation */
+#define CRC32C_POLY         0x82f63b78      /* reversed polynomial */
+static uint32_t crc32c_table[256];
+static volatile int crc32c_table_ready = 0;
+
+/* Update a CRC32C with size bytes from buf, one byte at a time */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    if(!crc32c_table_ready) {
+        uint32_t i, j, c;
+
+        /* Threads racing here compute identical values */
+        for(i = 0 ; i < 256 ; i++) {
+            c = i;
+            for(j = 0 ; j < 8 ; j++)
+                c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+            crc32c_table[i] = c;
+        }
+        crc32c_table_ready = 1;
+    }
+
+    while(size-- > 0)
+        crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return (crc);
+}
+
+#if defined(HAVE_SSE42_CRC32C)
+/* Update a CRC32C with size bytes from buf, 8 bytes per instruction */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    uint64_t crc64 = crc;
+
+    while((size > 0) && (((uintptr_t)buf & 7) != 0)) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+        size--;
+    }
+    while(size >= 8) {
+        uint64_t word;
+
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        size -= 8;
+    }
+    while(size-- > 0)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+    return ((uint32_t)crc64);
+}
+#endif
+
+#if defined(HAVE_IO_URING)
+/* io_uring(7) submission and completion rings, driven through raw system
+   calls (no liburing dependency) */
+struct uring {
+    int handle;                             /* ring file handle */
+    unsigned char *sq_ring;                 /* mapped submission ring */
+    size_t sq_ring_size;
+    unsigned char *cq_ring;                 /* mapped completion ring */
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;              /* mapped submission entries */
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_queued;                     /* entries not submitted yet */
+};
+
+#define URING_BATCH         256             /* members per batch */
+#define URING_ENTRIES       (2 * URING_BATCH) /* two operations per member */
+#define URING_ARENASIZE     (8 * 1024 * 1024) /* read buffer per batch */
+
+/* Tell if io_uring(7) extraction has been found usable (-1 : not probed) */
+static int uring_supported = -1;
+
+/* Set up a ring of entries submission entries
+   Returns 0 on success, -1 on error */
+static int
+uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    void *map;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    if((ring->handle = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return (-1);
+
+    /* Both rings may share a single mapping */
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    if((map = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->handle, IORING_OFF_SQ_RING))
+        == MAP_FAILED) {
+        close(ring->handle);
+        return (-1);
+    }
+    ring->sq_ring = map;
+    if(ring->cq_ring_size == 0)
+        ring->cq_ring = ring->sq_ring;
+    else if((map = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->handle, IORING_OFF_CQ_RING))
+        == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->handle);
+        return (-1);
+    }
+    else
+        ring->cq_ring = map;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if((map = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->handle, IORING_OFF_SQES))
+        == MAP_FAILED) {
+        if(ring->cq_ring_size != 0)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->handle);
+        return (-1);
+    }
+    ring->sqes = map;
+
+    ring->sq_head = (unsigned *)(ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + params.cq_off.cqes);
+    return (0);
+}
+
+/* Tear a ring down */
+static void
+uring_uninit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring_size != 0)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->handle);
+    return;
+}
+
+/* Queue a (zeroed) submission entry, to be filled by caller
+   Entries are submitted by uring_wait() */
+static struct io_uring_sqe *
+uring_queue(struct uring *ring, uint8_t opcode, int handle, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = handle;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_queued++;
+    return (sqe);
+}
+
+/* Submit queued entries and reap num_cqes completions, handing each of
+   them to complete()
+   Returns 0 on success, -1 on error */
+static int
+uring_wait(struct uring *ring, unsigned num_cqes,
+    void (*complete)(void *, uint64_t, int32_t), void *arg)
+{
+    while(num_cqes > 0) {
+        unsigned head = *ring->cq_head;
+        int ret;
+
+        /* Reap available completions */
+        while((num_cqes > 0) &&
+            (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            complete(arg, cqe->user_data, cqe->res);
+            head++;
+            num_cqes--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if(num_cqes == 0)
+            break;
+
+        /* Submit pending entries and wait for remaining completions */
+        if((ret = syscall(__NR_io_uring_enter, ring->handle, ring->sq_queued,
+            num_cqes, IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        ring->sq_queued -= ret;
+    }
+    return (0);
+}
+
+/* Tell if running kernel supports io_uring(7) as well as operations used
+   for extraction (Linux 5.6 and later, unless disabled) */
+static int
+uring_probe(void)
+{
+    static const uint8_t ops[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE
+    };
+    struct io_uring_probe *probe;
+    struct uring ring;
+    size_t probe_size;
+    unsigned i;
+    int supported = 0;
+
+    if(uring_init(&ring, 4) < 0)
+        return (0);
+    probe_size = sizeof(struct io_uring_probe) +
+        256 * sizeof(struct io_uring_probe_op);
+    if((probe = calloc(1, probe_size)) != NULL) {
+        if(syscall(__NR_io_uring_register, ring.handle,
+            IORING_REGISTER_PROBE, probe, 256) == 0) {
+            supported = 1;
+            for(i = 0 ; i < sizeof(ops) / sizeof(ops[0]) ; i++) {
+                if((ops[i] > probe->last_op) ||
+                    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                    supported = 0;
+            }
+        }
+        free(probe);
+    }
+    uring_uninit(&ring);
+    return (supported);
+}
+
+/* Member being extracted through io_uring(7) */
+struct uring_member {
+    const struct grp_file *file;
+    const char *data;                       /* member data */
+    int32_t length;                         /* bytes available in data */
+    int32_t handle;                         /* destination file or -errno */
+    int32_t written;                        /* bytes written or -errno */
+    int32_t closed;                         /* close(2) result */
+};
+
+/* Operations, stored in user_data's low bits (member index above) */
+#define URING_OP_OPEN       0
+#define URING_OP_READ       1
+#define URING_OP_WRITE      2
+#define URING_OP_CLOSE      3
+#define URING_USER_DATA(member, op)     (((uint64_t)(member) << 2) | (op))
+
+/* Record an operation's result into the member it belongs to */
+static void
+uring_complete_member(void *arg, uint64_t user_data, int32_t res)
+{
+    struct uring_member *member = &((struct uring_member *)arg)[user_data >> 2];
+
+    switch(user_data & 3) {
+        case URING_OP_OPEN:
+            member->handle = res;
+            break;
+        case URING_OP_READ:
+            member->length = res;
+            break;
+        case URING_OP_WRITE:
+            member->written = res;
+            break;
+        case URING_OP_CLOSE:
+            member->closed = res;
+            break;
+    }
+    return;
+}
+
+/* Extract a batch of members through ring, in two rounds : destination
+   files get created while member data is read from archive (or found in
+   its mapping), then each write is linked to the close of its file
+   (a file created by an operation cannot be referred to by a linked one
+   without registered files)
+   Returns 0 on success, -1 if a member could not be extracted, -2 if
+   ring failed */
+static int
+uring_extract_batch(struct grp_archive *archive, struct uring *ring,
+    struct uring_member *members, unsigned num_members, char *arena,
+    int dir_handle, int flags)
+{
+    unsigned num_cqes = 0;
+    size_t arena_used = 0;
+    unsigned i;
+    int err = 0;
+
+    /* First round : create files and read data */
+    for(i = 0 ; i < num_members ; i++) {
+        struct uring_member *member = &members[i];
+        const struct grp_file *file = member->file;
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_queue(ring, IORING_OP_OPENAT, dir_handle,
+            URING_USER_DATA(i, URING_OP_OPEN));
+        sqe->addr = (uintptr_t)file->file_name;
+        sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+        sqe->len = 0660;
+        num_cqes++;
+
+        member->length = file->file_size;
+        if(archive->map != NULL) {
+            member->data = (const char *)archive->map + file->file_offset;
+            if(file->file_offset >= archive->map_size)
+                member->length = 0;
+            else if(file->file_size > archive->map_size - file->file_offset)
+                member->length = archive->map_size - file->file_offset;
+        }
+        else if(file->file_size > 0) {
+            member->data = &arena[arena_used];
+            arena_used += file->file_size;
+            sqe = uring_queue(ring, IORING_OP_READ, archive->handle,
+                URING_USER_DATA(i, URING_OP_READ));
+            sqe->addr = (uintptr_t)member->data;
+            sqe->len = file->file_size;
+            sqe->off = file->file_offset;
+            num_cqes++;
+        }
+    }
+    if(uring_wait(ring, num_cqes, &uring_complete_member, members) < 0)
+        return (-2);
+
+    /* Second round : write data and close files */
+    num_cqes = 0;
+    for(i = 0 ; i < num_members ; i++) {
+        struct uring_member *member = &members[i];
+        struct io_uring_sqe *sqe;
+
+        member->written = 0;
+        member->closed = 0;
+        if(member->handle < 0)
+            continue;
+        if(member->length > 0) {
+            sqe = uring_queue(ring, IORING_OP_WRITE, member->handle,
+                URING_USER_DATA(i, URING_OP_WRITE));
+            sqe->addr = (uintptr_t)member->data;
+            sqe->len = member->length;
+            sqe->off = 0;
+            sqe->flags = IOSQE_IO_LINK;
+            num_cqes++;
+        }
+        uring_queue(ring, IORING_OP_CLOSE, member->handle,
+            URING_USER_DATA(i, URING_OP_CLOSE));
+        num_cqes++;
+    }
+    if(uring_wait(ring, num_cqes, &uring_complete_member, members) < 0)
+        return (-2);
+
+    /* Report results */
+    for(i = 0 ; i < num_members ; i++) {
+        struct uring_member *member = &members[i];
+        const struct grp_file *file = member->file;
+
+        if(member->handle < 0) {
+            fprintf(stderr, "cannot create destination file : %s\n",
+                file->file_name);
+            err = -1;
+            continue;
+        }
+        /* Close is cancelled when write fails */
+        if(member->closed == -ECANCELED)
+            close(member->handle);
+        if(member->length < 0) {
+            fprintf(stderr, "cannot read member data : %s\n",
+                file->file_name);
+            err = -1;
+        }
+        else if((member->written < 0) || (member->written < member->length)) {
+            fprintf(stderr, "incomplete write to destination file : "
+                "%s\n", file->file_name);
+            err = -1;
+        }
+        else if((uint32_t)member->length < file->file_size) {
+            fprintf(stderr, "file partially extracted : %s\n",
+                file->file_name);
+            err = -1;
+        }
+        else if(flags & GRP_VERBOSE)
+            fprintf(stdout, "%s (%s)\n", file->file_name,
+                copy_strategy_names[COPY_IO_URING]);
+    }
+    return (err);
+}
+#endif
+
+/*
+ * Public API, see libgrp.h
+ */
+
+struct grp_archive *
+grp_open(const char *filename, int flags)
+{
+    struct grp_archive *archive;
+    char *idx_filename = NULL;
+
+    if(filename == NULL) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (NULL);
+    }
+    if((flags & GRP_OPEN_INDEX) && (strcmp(filename, "-") != 0)) {
+        if((idx_filename = malloc(strlen(filename) +
+            strlen(GRPIDX_SUFFIX) + 1)) == NULL) {
+            fprintf(stderr, "cannot allocate memory\n");
+            return (NULL);
+        }
+        strcpy(idx_filename, filename);
+        strcat(idx_filename, GRPIDX_SUFFIX);
+    }
+
+    if((archive = malloc(sizeof(struct grp_archive))) == NULL) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(idx_filename);
+        return (NULL);
+    }
+    if(init_grp_files(filename,
+        (flags & GRP_OPEN_MMAP) ? ENGINE_MMAP : ENGINE_FD, idx_filename,
+        archive) < 0) {
+        free(idx_filename);
+        free(archive);
+        return (NULL);
+    }
+
+    /* Index file missing or stale : build name index, then save it */
+    if(archive->idx_map == NULL) {
+        if(init_grp_index(archive->files, archive->num_files,
+            &archive->index) < 0) {
+            uninit_grp_files(archive);
+            free(idx_filename);
+            free(archive);
+            return (NULL);
+        }
+#if defined(HAVE_MMAP)
+        if(idx_filename != NULL)
+            write_grp_index_file(archive, idx_filename);
+#endif
+    }
+    free(idx_filename);
+    return (archive);
+}
+
+void
+grp_close(struct grp_archive *archive)
+{
+    if(archive == NULL)
+        return;
+    /* Index file (if any) is unmapped first, leaving no index to free */
+    uninit_grp_files(archive);
+    uninit_grp_index(&archive->index);
+    free(archive);
+    return;
+}
+
+uint32_t
+grp_num_files(const struct grp_archive *archive)
+{
+    return (archive->num_files);
+}
+
+const struct grp_file *
+grp_next(const struct grp_archive *archive, const struct grp_file *file)
+{
+    uint32_t next = (file == NULL) ? 0 : file->index;
+
+    return ((next < archive->num_files) ? &archive->files[next] : NULL);
+}
+
+const struct grp_file *
+grp_lookup(const struct grp_archive *archive, const char *name)
+{
+    if(name == NULL)
+        return (NULL);
+    return (lookup_grp_file(archive->files, &archive->index, name));
+}
+
+ssize_t
+grp_pread(struct grp_archive *archive, const struct grp_file *file,
+    void *buf, size_t count, uint64_t offset)
+{
+    ssize_t bytes;
+
+    if((archive == NULL) || (file == NULL) || (buf == NULL)) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if(offset >= file->file_size)
+        return (0);
+    if(count > file->file_size - offset)
+        count = file->file_size - offset;
+    offset += file->file_offset;
+
+    /* Mapped archive */
+    if(archive->map != NULL) {
+        if(offset >= archive->map_size)
+            return (0);
+        if(count > archive->map_size - offset)
+            count = archive->map_size - offset;
+        memcpy(buf, archive->map + offset, count);
+        return (count);
+    }
+
+    /* Forward-only archive */
+    if(archive->streaming) {
+        if((archive->stream_buf == NULL) &&
+            ((archive->stream_buf = malloc(COPY_BUFSIZE)) == NULL))
+            return (-1);
+        if((bytes = stream_seek(archive, offset)) != 0)
+            return ((bytes < 0) ? -1 : 0);
+        if((bytes = read_full(archive->handle, buf, count)) > 0)
+            archive->stream_offset += bytes;
+        return (bytes);
+    }
+
+    while(((bytes = pread(archive->handle, buf, count, offset)) < 0) &&
+        (errno == EINTR))
+        continue;
+    return (bytes);
+}
+
+ssize_t
+grp_pread_archive(struct grp_archive *archive, void *buf, size_t count,
+    uint64_t offset)
+{
+    char *p = buf;
+    size_t done = 0;
+
+    if((archive == NULL) || (buf == NULL)) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if(archive->streaming) {
+        errno = ESPIPE;
+        return (-1);
+    }
+
+    /* Mapped archive */
+    if(archive->map != NULL) {
+        if(offset >= archive->map_size)
+            return (0);
+        if(count > archive->map_size - offset)
+            count = archive->map_size - offset;
+        memcpy(buf, archive->map + offset, count);
+        return (count);
+    }
+
+    /* Retry on short reads, until end of archive */
+    while(done < count) {
+        ssize_t bytes = pread(archive->handle, p + done, count - done,
+            offset + done);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        if(bytes == 0)
+            break;
+        done += bytes;
+    }
+    return (done);
+}
+
+int64_t
+grp_archive_size(const struct grp_archive *archive)
+{
+    struct stat archive_stat;
+
+    if(archive->map != NULL)
+        return (archive->map_size);
+    if(archive->streaming || (fstat(archive->handle, &archive_stat) < 0) ||
+        !S_ISREG(archive_stat.st_mode))
+        return (-1);
+    return (archive_stat.st_size);
+}
+
+int
+grp_write_full(int handle, const void *buf, size_t size)
+{
+    const char *p = buf;
+
+    while(size > 0) {
+        ssize_t bytes = write(handle, p, size);
+
+        if(bytes < 0) {
+            if(errno == EINTR)
+                continue;
+            return (-1);
+        }
+        p += bytes;
+        size -= bytes;
+    }
+    return (0);
+}
+
+uint32_t
+grp_crc32c(uint32_t crc, const void *buf, size_t size)
+{
+#if defined(HAVE_SSE42_CRC32C)
+    static int sse42 = -1;
+
+    if(sse42 < 0)
+        sse42 = __builtin_cpu_supports("sse4.2");
+    if(sse42)
+        return (~crc32c_sse42(~crc, buf, size));
+#endif
+    return (~crc32c_sw(~crc, buf, size));
+}
+
+int64_t
+grp_checksum(struct grp_archive *archive, const struct grp_file *file,
+    void *buf, size_t buf_size, uint32_t *crc)
+{
+    uint64_t done = 0;
+    ssize_t bytes;
+
+    if((archive == NULL) || (file == NULL) || (crc == NULL) ||
+        ((archive->map == NULL) && ((buf == NULL) || (buf_size == 0)))) {
+        errno = EINVAL;
+        return (-1);
+    }
+    *crc = 0;
+
+    /* Mapped archive : checksum data in place */
+    if(archive->map != NULL) {
+        if(file->file_offset >= archive->map_size)
+            return (0);
+        done = file->file_size;
+        if(done > archive->map_size - file->file_offset)
+            done = archive->map_size - file->file_offset;
+        *crc = grp_crc32c(0, archive->map + file->file_offset, done);
+        return (done);
+    }
+
+    while(done < file->file_size) {
+        if((bytes = grp_pread(archive, file, buf, buf_size, done)) < 0)
+            return (-1);
+        if(bytes == 0)
+            break;
+        *crc = grp_crc32c(*crc, buf, bytes);
+        done += bytes;
+    }
+    return (done);
+}
+
+int
+grp_is_mapped(const struct grp_archive *archive)
+{
+    return (archive->map != NULL);
+}
+
+int
+grp_is_streaming(const struct grp_archive *archive)
+{
+    return (archive->streaming);
+}
+
+void
+grp_advise(struct grp_archive *archive, const struct grp_file *file,
+    int advice)
+{
+    if(file == NULL)
+        advise_grp_archive(archive, 0, 0, advice);
+    else if(advice == GRP_ADVICE_WILLNEED)
+        grp_advise_span(archive, file, file, advice);
+    return;
+}
+
+void
+grp_advise_span(struct grp_archive *archive, const struct grp_file *first,
+    const struct grp_file *last, int advice)
+{
+    if((first == NULL) || (last == NULL) ||
+        (last->file_offset < first->file_offset) ||
+        (advice != GRP_ADVICE_WILLNEED))
+        return;
+
+    /* Empty span : nothing to read */
+    if(last->file_offset + last->file_size == first->file_offset)
+        return;
+    advise_grp_archive(archive, first->file_offset,
+        last->file_offset + last->file_size - first->file_offset, advice);
+    return;
+}
+
+int64_t
+grp_extract_fd(struct grp_archive *archive, const struct grp_file *file,
+    int dst_handle, int *strategy)
+{
+    if(file == NULL) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+    return (grp_extract_range_fd(archive, file, 0, file->file_size,
+        dst_handle, strategy));
+}
+
+int64_t
+grp_extract_range_fd(struct grp_archive *archive, const struct grp_file *file,
+    uint64_t offset, uint64_t count, int dst_handle, int *strategy)
+{
+    int64_t copied;
+
+    if((archive == NULL) || (file == NULL) || (strategy == NULL)) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+    if(offset > file->file_size)
+        offset = file->file_size;
+    if(count > file->file_size - offset)
+        count = file->file_size - offset;
+    offset += file->file_offset;
+
+    /* Mapped archive : single write(2) from mapping */
+    if(archive->map != NULL) {
+        *strategy = COPY_MMAP;
+        return (write_mapped_data(archive, offset, dst_handle,
+            (uint32_t)count));
+    }
+
+    /* Forward-only archive : skip data up to file, then copy it */
+    if(archive->streaming) {
+        *strategy = COPY_READ_WRITE;
+        if((archive->stream_buf == NULL) &&
+            ((archive->stream_buf = malloc(COPY_BUFSIZE)) == NULL)) {
+            fprintf(stderr, "cannot allocate memory\n");
+            return (-1);
+        }
+        if((copied = stream_seek(archive, offset)) != 0)
+            return ((copied < 0) ? -1 : 0);
+        if((copied = stream_file_data(archive->handle, dst_handle,
+            count, archive->stream_buf, COPY_BUFSIZE, strategy)) > 0)
+            archive->stream_offset += copied;
+        return (copied);
+    }
+
+    return (copy_file_data(archive->handle, offset, dst_handle, count,
+        strategy));
+}
+
+const char *
+grp_strategy_name(int strategy)
+{
+    if((strategy < 0) || (strategy >=
+        (int)(sizeof(copy_strategy_names) / sizeof(copy_strategy_names[0]))))
+        return ("unknown");
+    return (copy_strategy_names[strategy]);
+}
+
+int
+grp_create(const char *filename, char **paths, int num_paths, int flags)
+{
+    return (create_grp_archive(filename, paths, num_paths,
+        (flags & GRP_VERBOSE) != 0));
+}
+
+int
+grp_update(const char *filename, char **paths, int num_paths, int flags)
+{
+    return (update_grp_archive(filename, paths, num_paths,
+        (flags & GRP_UPDATE_REPLACE) != 0, (flags & GRP_VERBOSE) != 0));
+}
+
+int
+grp_uring_supported(void)
+{
+#if defined(HAVE_IO_URING)
+    if(uring_supported < 0)
+        uring_supported = uring_probe();
+    return (uring_supported);
+#else
+    return (0);
+#endif
+}
+
+int
+grp_extract_uring(struct grp_archive *archive, const struct grp_file **files,
+    uint32_t num_files, int dir_handle, int flags)
+{
+#if defined(HAVE_IO_URING)
+    struct uring ring;
+    struct uring_member *members;
+    char *arena = NULL;
+    uint32_t next = 0;
+    int err = 0;
+
+    if((archive == NULL) || ((files == NULL) && (num_files > 0))) {
+        fprintf(stderr, "%s(): invalid argument\n", __func__);
+        return (-1);
+    }
+    if(archive->streaming || !grp_uring_supported()) {
+        fprintf(stderr, "io_uring unavailable\n");
+        errno = ENOSYS;
+        return (-1);
+    }
+
+    if(((members = malloc(sizeof(struct uring_member) * URING_BATCH))
+        == NULL) || ((archive->map == NULL) &&
+        ((arena = malloc(URING_ARENASIZE)) == NULL))) {
+        fprintf(stderr, "cannot allocate memory\n");
+        free(members);
+        return (-1);
+    }
+    if(uring_init(&ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "cannot set up io_uring\n");
+        free(arena);
+        free(members);
+        return (-1);
+    }
+
+    while(next < num_files) {
+        unsigned num_members = 0;
+        size_t arena_used = 0;
+        int ret;
+
+        /* Fill a batch, up to read buffer size */
+        while((next < num_files) && (num_members < URING_BATCH)) {
+            const struct grp_file *file = files[next];
+
+            if(file->file_size > GRP_URING_MAXSIZE) {
+                fprintf(stderr, "file too large for io_uring : %s\n",
+                    file->file_name);
+                err = -1;
+                next++;
+                continue;
+            }
+            if(archive->map == NULL) {
+                if(arena_used + file->file_size > URING_ARENASIZE)
+                    break;
+                arena_used += file->file_size;
+            }
+            members[num_members++].file = file;
+            next++;
+        }
+
+        if((ret = uring_extract_batch(archive, &ring, members, num_members,
+            arena, dir_handle, flags)) < -1) {
+            fprintf(stderr, "io_uring error, extraction aborted\n");
+            err = -1;
+            break;
+        }
+        err |= ret;
+    }
+
+    uring_uninit(&ring);
+    free(arena);
+    free(members);
+    return (err);
+#else
+    fprintf(stderr, "io_uring unavailable\n");
+    errno = ENOSYS;
+    return (-1);
+#endif
+}
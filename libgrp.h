@@ -0,0 +1,205 @@
+/*-
+ * Copyright (c) 2010-2014 Ganael LAPLANCHE <ganael.laplanche@martymac.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+   libgrp : Build engine group archive (.grp) library
+
+   Typical use :
+
+   struct grp_archive *archive = grp_open("DUKE3D.GRP", 0);
+   const struct grp_file *file = grp_lookup(archive, "GAME.CON");
+   ssize_t n = grp_pread(archive, file, buf, sizeof(buf), 0);
+   [...]
+   grp_close(archive);
+
+   An open archive may be shared by several threads (lookups and reads use
+   no shared file position), except when it is read from standard input.
+*/
+
+#ifndef _LIBGRP_H_
+#define _LIBGRP_H_
+
+/* uint32_t, uint64_t */
+#include <stdint.h>
+
+/* ssize_t */
+#include <sys/types.h>
+#if defined(_MSC_VER)
+  typedef int ssize_t;
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GRP_FILENAMELEN         12          /* max file name length */
+
+/* File entry within group archive */
+struct grp_file {
+    uint32_t index;                         /* file position (from 1) */
+    char file_name[GRP_FILENAMELEN + 1];    /* file name + '\0' */
+    uint32_t file_size;                     /* file size in bytes */
+    uint64_t file_offset;                   /* file offset in group archive */
+};
+
+/* Group archive (opaque) */
+struct grp_archive;
+
+/* grp_open() flags */
+#define GRP_OPEN_MMAP           0x01        /* map archive, if possible */
+#define GRP_OPEN_INDEX          0x02        /* use (or write) an index file */
+
+/* Open a group archive and load its TOC, filename "-" meaning standard
+   input (read forward only)
+   With GRP_OPEN_INDEX, TOC and name index are mapped from a sidecar index
+   file (filename + ".grpidx") when it matches archive's size, modification
+   time and inode ; otherwise, that file is (re)written for later opens
+   Returns NULL on error */
+struct grp_archive *grp_open(const char *filename, int flags);
+
+/* Close a group archive */
+void grp_close(struct grp_archive *archive);
+
+/* Number of files within archive */
+uint32_t grp_num_files(const struct grp_archive *archive);
+
+/* Iterate over files, in archive order : returns first file if file is
+   NULL, NULL after last one */
+const struct grp_file *grp_next(const struct grp_archive *archive,
+    const struct grp_file *file);
+
+/* Look a file up by name (case-insensitively)
+   Returns NULL if not found */
+const struct grp_file *grp_lookup(const struct grp_archive *archive,
+    const char *name);
+
+/* Read up to count bytes of a file, from offset within that file
+   Returns the number of bytes read (0 at end of file) or -1 on error */
+ssize_t grp_pread(struct grp_archive *archive, const struct grp_file *file,
+    void *buf, size_t count, uint64_t offset);
+
+/* Read up to count bytes of archive data, from offset within archive (e.g.
+   several adjacent files at once) ; archive must not be read from standard
+   input
+   Returns the number of bytes read (less than count at end of archive) or
+   -1 on error */
+ssize_t grp_pread_archive(struct grp_archive *archive, void *buf,
+    size_t count, uint64_t offset);
+
+/* Size of archive in bytes, -1 if unknown (read from standard input) */
+int64_t grp_archive_size(const struct grp_archive *archive);
+
+/* Write size bytes of buf to handle, retrying on short writes
+   Returns 0 on success, -1 on error */
+int grp_write_full(int handle, const void *buf, size_t size);
+
+/* Update a CRC32C (Castagnoli) checksum with size bytes from buf, crc
+   being 0 at first (hardware-accelerated when supported by running CPU) */
+uint32_t grp_crc32c(uint32_t crc, const void *buf, size_t size);
+
+/* Compute a file's CRC32C into *crc, reading it through buf (buf_size
+   bytes, unused for memory-mapped archives)
+   Returns the number of bytes checksummed (less than file size if archive
+   is truncated) or -1 on error */
+int64_t grp_checksum(struct grp_archive *archive,
+    const struct grp_file *file, void *buf, size_t buf_size, uint32_t *crc);
+
+/* Tell if archive is memory-mapped / read forward only */
+int grp_is_mapped(const struct grp_archive *archive);
+int grp_is_streaming(const struct grp_archive *archive);
+
+/* Access pattern hints (madvise(2) for memory-mapped archives,
+   posix_fadvise(2) otherwise) */
+#define GRP_ADVICE_SEQUENTIAL   0           /* whole archive, in order */
+#define GRP_ADVICE_RANDOM       1           /* a few files, here and there */
+#define GRP_ADVICE_WILLNEED     2           /* given file(s), soon */
+
+/* Give a hint about how archive (file being NULL) or a file will be
+   accessed */
+void grp_advise(struct grp_archive *archive, const struct grp_file *file,
+    int advice);
+
+/* Give a GRP_ADVICE_WILLNEED hint for the archive span holding files first
+   to last (last not being before first in archive) */
+void grp_advise_span(struct grp_archive *archive,
+    const struct grp_file *first, const struct grp_file *last, int advice);
+
+/* Copy a file to dst_handle's current position, using the fastest
+   strategy available (in-kernel copy when possible)
+   Sets *strategy (see grp_strategy_name())
+   Returns the number of bytes copied (less than file size if archive is
+   truncated) or -1 on error */
+int64_t grp_extract_fd(struct grp_archive *archive,
+    const struct grp_file *file, int dst_handle, int *strategy);
+
+/* Copy count bytes of a file, from offset within that file, to
+   dst_handle's current position, as grp_extract_fd() does
+   Returns the number of bytes copied (less than count if archive is
+   truncated) or -1 on error */
+int64_t grp_extract_range_fd(struct grp_archive *archive,
+    const struct grp_file *file, uint64_t offset, uint64_t count,
+    int dst_handle, int *strategy);
+
+/* Name of a copy strategy */
+const char *grp_strategy_name(int strategy);
+
+/* Tell if io_uring(7) extraction is supported by the running kernel
+   (Linux 5.6 and later) */
+int grp_uring_supported(void);
+
+/* Extract small files (up to GRP_URING_MAXSIZE bytes each) into directory
+   dir_handle, under their own names, keeping hundreds of them in flight
+   through a single io_uring(7) ring ; archive must not be read from
+   standard input
+   Reports each file written with GRP_VERBOSE
+   Returns 0 on success, -1 if some files could not be extracted (errno
+   set to ENOSYS if io_uring(7) is unavailable) */
+#define GRP_URING_MAXSIZE       (64 * 1024)
+int grp_extract_uring(struct grp_archive *archive,
+    const struct grp_file **files, uint32_t num_files, int dir_handle,
+    int flags);
+
+/* grp_create() / grp_update() / grp_extract_uring() flags */
+#define GRP_UPDATE_REPLACE      0x01        /* replace existing files */
+#define GRP_VERBOSE             0x80        /* report files written */
+
+/* Create a group archive from a list of files (stored under their base
+   names)
+   Returns 0 on success, -1 on error (archive then being removed) */
+int grp_create(const char *filename, char **paths, int num_paths,
+    int flags);
+
+/* Add files to an existing group archive, replacing existing ones with
+   GRP_UPDATE_REPLACE (refusing to add them otherwise)
+   Returns 0 on success, -1 on error (archive then being left unchanged) */
+int grp_update(const char *filename, char **paths, int num_paths,
+    int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBGRP_H_ */